@@ -0,0 +1,267 @@
+#include "JPGDecoder.hpp"
+#include "ImageWriter.hpp"
+#include "ThreadPool.hpp"
+#include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+// Decodes many JPGs on all cores, every worker decodes whole images and steals files from the other
+// workers once its own ones are done.
+//
+// BatchDecode [-t threads] [-s scale] [-o outputDir] [-f bmp|ppm|raw] [-l listFile] files or directories...
+//
+// The images of a directory are written to the same subdirectories of outputDir that they are in below that
+// directory, files that are given directly go to outputDir itself. Files that would overwrite the output of an
+// earlier file fail.
+
+namespace fs = std::filesystem;
+
+namespace {
+	struct Input {
+		std::string file;
+		fs::path output; // relative to the output directory, without the extension of the output format
+	};
+
+	struct Settings {
+		std::vector<Input> files;
+		std::string outputDir; // empty = decode into memory only
+		JPG::ImageFormat outputFormat = JPG::ImageFormat::BMP;
+		uint32_t numThreads = 0;
+		uint32_t scale = 1;
+	};
+
+	// state a worker keeps from one image to the next
+	struct Worker {
+		std::deque<uint32_t> files; // owner takes from the front, thieves from the back
+		std::mutex mutex;
+		JPG::Decoder decoder; // keeps its memory, so decoding stops allocating after the first few images
+		uint32_t numDecoded = 0;
+		uint32_t numFailed = 0;
+		uint64_t inputBytes = 0;
+		uint64_t outputBytes = 0;
+	};
+
+	bool IsJPGFile(const fs::path& path) {
+		std::string extension = path.extension().string();
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return char(std::tolower(c)); });
+		return extension == ".jpg" || extension == ".jpeg";
+	}
+
+	void AddInput(const std::string& input, std::vector<Input>& files) {
+		if (fs::is_directory(input)) {
+			std::vector<Input> found;
+			for (const fs::directory_entry& entry : fs::recursive_directory_iterator(input)) {
+				if (entry.is_regular_file() && IsJPGFile(entry.path())) {
+					found.push_back({ entry.path().string(), entry.path().lexically_relative(input) });
+				}
+			}
+			std::sort(found.begin(), found.end(), [](const Input& a, const Input& b) { return a.file < b.file; });
+			files.insert(files.end(), found.begin(), found.end());
+		}
+		else {
+			files.push_back({ input, fs::path(input).filename() });
+		}
+	}
+
+	Settings ParseArguments(int argc, char** argv) {
+		Settings settings;
+		auto value = [&](int& i) -> std::string {
+			if (i + 1 >= argc) {
+				throw std::invalid_argument(std::string("Error - Missing value for ") + argv[i]);
+			}
+			return argv[++i];
+		};
+		for (int i = 1; i < argc; i++) {
+			const std::string arg = argv[i];
+			if (arg == "-t") {
+				settings.numThreads = std::stoul(value(i));
+			}
+			else if (arg == "-s") {
+				settings.scale = std::stoul(value(i));
+			}
+			else if (arg == "-o") {
+				settings.outputDir = value(i);
+			}
+			else if (arg == "-f") {
+				const std::string format = value(i);
+				if (format == "bmp") {
+					settings.outputFormat = JPG::ImageFormat::BMP;
+				}
+				else if (format == "ppm") {
+					settings.outputFormat = JPG::ImageFormat::PPM;
+				}
+				else if (format == "raw") {
+					settings.outputFormat = JPG::ImageFormat::Raw;
+				}
+				else {
+					throw std::invalid_argument("Error - Unknown output format " + format);
+				}
+			}
+			else if (arg == "-l") {
+				std::ifstream list(value(i));
+				if (!list) {
+					throw std::invalid_argument("Error - Cannot open file list");
+				}
+				std::string line;
+				while (std::getline(list, line)) {
+					if (!line.empty() && line.back() == '\r') {
+						line.pop_back();
+					}
+					if (!line.empty()) {
+						AddInput(line, settings.files);
+					}
+				}
+			}
+			else {
+				AddInput(arg, settings.files);
+			}
+		}
+		return settings;
+	}
+
+	const char* FileExtension(const JPG::ImageFormat format) {
+		switch (format) {
+		case JPG::ImageFormat::BMP:
+			return ".bmp";
+		case JPG::ImageFormat::PPM:
+			return ".ppm";
+		default:
+			return ".raw";
+		}
+	}
+
+	// Sets the output path of every file and creates the subdirectories of the output directory. A file whose
+	// output path is the same as the one of an earlier file gets an empty path and the error in collisions.
+	void PrepareOutputs(Settings& settings, std::map<uint32_t, std::string>& collisions) {
+		std::map<fs::path, uint32_t> outputs;
+		for (uint32_t i = 0; i < settings.files.size(); i++) {
+			Input& input = settings.files[i];
+			input.output = (fs::path(settings.outputDir) / input.output).replace_extension(FileExtension(settings.outputFormat)).lexically_normal();
+			const auto inserted = outputs.insert({ input.output, i });
+			if (!inserted.second) {
+				collisions[i] = "Error - Output file " + input.output.string() + " is already written for " + settings.files[inserted.first->second].file;
+				input.output.clear();
+				continue;
+			}
+			fs::create_directories(input.output.parent_path());
+		}
+	}
+
+	void DecodeFile(const Settings& settings, const Input& input, Worker& worker) {
+		const std::string& fileName = input.file;
+		JPG::Decoder& decoder = worker.decoder;
+		decoder.options.scale = settings.scale;
+		decoder.options.numThreads = 1; // the images are decoded in parallel instead
+		const JPG::JPGFile& contents = decoder.Read(fileName);
+
+		if (!settings.outputDir.empty()) {
+			decoder.options.pixelFormat = JPG::ImageWriter::FilePixelFormat(settings.outputFormat, JPG::PixelFormat::RGB8);
+			JPG::ImageWriter writer(input.output.string(), settings.outputFormat, contents.outputWidth, contents.outputHeight, decoder.options.pixelFormat);
+			decoder.DecodeRows(writer.RowWriter());
+			writer.Close();
+		}
+		else {
+			decoder.Decode();
+		}
+		worker.inputBytes += fs::file_size(fileName);
+		worker.outputBytes += uint64_t(contents.outputWidth) * contents.outputHeight * 3;
+	}
+}
+
+int main(int argc, char** argv) {
+	Settings settings;
+	std::map<uint32_t, std::string> collisions; // files that are not decoded because of their output path
+	try {
+		settings = ParseArguments(argc, argv);
+		if (!settings.outputDir.empty()) {
+			fs::create_directories(settings.outputDir);
+			PrepareOutputs(settings, collisions);
+		}
+	}
+	catch (const std::exception& e) {
+		std::cout << e.what() << '\n';
+		return 1;
+	}
+	if (settings.files.empty()) {
+		std::cout << "Usage: BatchDecode [-t threads] [-s scale] [-o outputDir] [-f bmp|ppm|raw] [-l listFile] files or directories...\n";
+		return 1;
+	}
+
+	JPG::ThreadPool pool(settings.numThreads);
+	const uint32_t numWorkers = std::min<uint32_t>(pool.NumThreads(), uint32_t(settings.files.size()));
+	std::vector<Worker> workers(numWorkers);
+	// every worker starts with a contiguous share of the files
+	for (uint32_t i = 0; i < settings.files.size(); i++) {
+		workers[uint64_t(i) * numWorkers / settings.files.size()].files.push_back(i);
+	}
+
+	std::mutex errorMutex;
+
+	const auto start = std::chrono::steady_clock::now();
+	pool.ParallelFor(numWorkers, [&](uint32_t id) {
+		Worker& worker = workers[id];
+		while (true) {
+			uint32_t file = 0;
+			bool found = false;
+			{
+				std::lock_guard<std::mutex> lock(worker.mutex);
+				if (!worker.files.empty()) {
+					file = worker.files.front();
+					worker.files.pop_front();
+					found = true;
+				}
+			}
+			// steal from the back of the other workers' queues
+			for (uint32_t i = 1; i < numWorkers && !found; i++) {
+				Worker& victim = workers[(id + i) % numWorkers];
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (!victim.files.empty()) {
+					file = victim.files.back();
+					victim.files.pop_back();
+					found = true;
+				}
+			}
+			if (!found) {
+				return;
+			}
+
+			try {
+				const auto collision = collisions.find(file);
+				if (collision != collisions.end()) {
+					throw std::invalid_argument(collision->second);
+				}
+				DecodeFile(settings, settings.files[file], worker);
+				worker.numDecoded++;
+			}
+			catch (const std::exception& e) {
+				worker.numFailed++;
+				std::lock_guard<std::mutex> lock(errorMutex);
+				std::cerr << settings.files[file].file << ": " << e.what() << '\n';
+			}
+		}
+	});
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint32_t numDecoded = 0;
+	uint32_t numFailed = 0;
+	uint64_t inputBytes = 0;
+	uint64_t outputBytes = 0;
+	for (const Worker& worker : workers) {
+		numDecoded += worker.numDecoded;
+		numFailed += worker.numFailed;
+		inputBytes += worker.inputBytes;
+		outputBytes += worker.outputBytes;
+	}
+	std::cout << "Decoded " << numDecoded << " images (" << numFailed << " failed) on " << numWorkers << " threads in " << seconds << " s\n";
+	std::cout << "  " << numDecoded / seconds << " images/s\n";
+	std::cout << "  " << inputBytes / seconds / 1e6 << " MB/s of JPG data\n";
+	std::cout << "  " << outputBytes / seconds / 1e6 << " MB/s of RGB pixels\n";
+	return numFailed == 0 ? 0 : 1;
+}
@@ -0,0 +1,404 @@
+#include "JPGDecoder.hpp"
+#include "JPGKernels.hpp"
+#include "JPGEncoder.hpp"
+#include <filesystem>
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+// Times the decoder in two suites and writes the results as JSON for comparing builds:
+//  - stages: every stage of the multi pass pipeline on a few fixed images (header parsing, huffman decoding,
+//    dequantization + IDCT, the reference IDCT, upsampling + color conversion and writing a BMP) and the color
+//    conversion kernel alone on every SIMD level that the CPU supports
+//  - decode: whole decodes with the default options over a synthetic corpus of different sizes, qualities,
+//    restart intervals and component layouts
+//
+// Benchmark [-t threads] [-m minSeconds] [-j results.json] [-c corpusDir] [-q] [files...]
+//
+// -c keeps the generated corpus in a directory (and reuses it), -q uses a smaller corpus, the files are added
+// to both suites. A library built with JPG_STATS adds the DecodeStats of every image to the decode suite.
+
+namespace fs = std::filesystem;
+
+namespace {
+	struct Settings {
+		uint32_t numThreads = 1;
+		double minSeconds = 0.25; // every measurement repeats until it took this long (and at least 3 times)
+		std::string resultsFile;
+		std::string corpusDir;
+		bool quick = false;
+		std::vector<std::string> files;
+	};
+
+	// an image of a suite, synthetic ones know how they were encoded
+	struct Image {
+		std::string name;
+		std::vector<JPG::byte> data;
+		bool synthetic = false;
+		JPG::EncodeSettings encodeSettings;
+	};
+
+	struct StageResult {
+		std::string image;
+		std::string stage;
+		double milliseconds;
+		double megapixelsPerSecond;
+	};
+
+	struct DecodeResult {
+		const Image* image;
+		JPG::JPGInfo info;
+		double milliseconds;
+		double megapixelsPerSecond;
+		double megabytesPerSecond; // of JPG data
+		JPG::DecodeStats stats; // of one more decode, if the library counts them
+	};
+
+	Settings ParseArguments(int argc, char** argv) {
+		Settings settings;
+		auto value = [&](int& i) -> std::string {
+			if (i + 1 >= argc) {
+				throw std::invalid_argument(std::string("Error - Missing value for ") + argv[i]);
+			}
+			return argv[++i];
+		};
+		for (int i = 1; i < argc; i++) {
+			const std::string arg = argv[i];
+			if (arg == "-t") {
+				settings.numThreads = std::stoul(value(i));
+			}
+			else if (arg == "-m") {
+				settings.minSeconds = std::stod(value(i));
+			}
+			else if (arg == "-j") {
+				settings.resultsFile = value(i);
+			}
+			else if (arg == "-c") {
+				settings.corpusDir = value(i);
+			}
+			else if (arg == "-q") {
+				settings.quick = true;
+			}
+			else {
+				settings.files.push_back(arg);
+			}
+		}
+		return settings;
+	}
+
+	std::vector<JPG::byte> ReadFile(const std::string& fileName) {
+		std::ifstream file(fileName, std::ios::binary);
+		if (!file) {
+			throw std::invalid_argument("Error - Cannot open " + fileName);
+		}
+		return std::vector<JPG::byte>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	const char* SamplingName(const JPG::EncodeSettings& settings) {
+		if (settings.numComponents == 1) {
+			return "gray";
+		}
+		if (settings.lumaHSF == 2) {
+			return settings.lumaVSF == 2 ? "4:2:0" : "4:2:2";
+		}
+		return "4:4:4";
+	}
+
+	Image SyntheticJPG(const uint32_t width, const uint32_t height, const JPG::EncodeSettings& encodeSettings, const Settings& settings) {
+		Image image;
+		image.synthetic = true;
+		image.encodeSettings = encodeSettings;
+		std::string sampling = SamplingName(encodeSettings);
+		sampling.erase(std::remove(sampling.begin(), sampling.end(), ':'), sampling.end());
+		image.name = std::to_string(width) + "x" + std::to_string(height) + "_q" + std::to_string(encodeSettings.quality) + "_" + sampling +
+			(encodeSettings.restartInterval != 0 ? "_rst" + std::to_string(encodeSettings.restartInterval) : "") + ".jpg";
+
+		const fs::path path = settings.corpusDir.empty() ? fs::path() : fs::path(settings.corpusDir) / image.name;
+		if (!path.empty() && fs::exists(path)) {
+			image.data = ReadFile(path.string());
+			return image;
+		}
+		const std::vector<JPG::byte> pixels = JPG::SyntheticImage(width, height, width * 31 + height);
+		image.data = JPG::EncodeJPG(pixels.data(), width, height, encodeSettings);
+		if (!path.empty()) {
+			std::ofstream file(path, std::ios::binary);
+			file.write(reinterpret_cast<const char*>(image.data.data()), image.data.size());
+		}
+		return image;
+	}
+
+	// seconds of every run of f, repeated until they add up to minSeconds
+	template<typename Function>
+	std::vector<double> Repeat(const double minSeconds, Function f) {
+		std::vector<double> seconds;
+		double total = 0;
+		while (seconds.size() < 3 || total < minSeconds) {
+			const auto start = std::chrono::steady_clock::now();
+			f();
+			seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			total += seconds.back();
+		}
+		return seconds;
+	}
+
+	double Median(std::vector<double> values) {
+		std::sort(values.begin(), values.end());
+		return values[values.size() / 2];
+	}
+
+	std::string JSONString(const std::string& text) {
+		std::string result = "\"";
+		for (const char c : text) {
+			if (c == '"' || c == '\\') {
+				result += '\\';
+			}
+			result += c;
+		}
+		return result + '"';
+	}
+
+	const char* LevelName(const JPG::SIMDLevel level) {
+		switch (level) {
+		case JPG::SIMDLevel::SSE2:
+			return "sse2";
+		case JPG::SIMDLevel::AVX2:
+			return "avx2";
+		case JPG::SIMDLevel::AVX512:
+			return "avx512";
+		default:
+			return "scalar";
+		}
+	}
+
+	std::vector<StageResult> BenchmarkStages(const Image& image, const Settings& settings) {
+		std::unique_ptr<JPG::JPGFile> contents = JPG::JPGDecoder::ReadJPG(image.data.data(), image.data.size());
+		const double megapixels = double(contents->width) * contents->height / 1e6;
+		std::vector<StageResult> results;
+		auto add = [&](const std::string& stage, const double seconds) {
+			results.push_back({ image.name, stage, seconds * 1000, megapixels / seconds });
+		};
+
+		add("read", Median(Repeat(settings.minSeconds, [&]() {
+			JPG::JPGDecoder::ReadJPG(image.data.data(), image.data.size());
+		})));
+
+		// the stages are timed inside of the same decodes
+		JPG::DecodeOptions options;
+		options.numThreads = settings.numThreads;
+		std::vector<JPG::byte> pixels(size_t(contents->width) * contents->height * 3);
+		std::vector<double> huffman;
+		std::vector<double> idct;
+		std::vector<double> color;
+		Repeat(settings.minSeconds * 3, [&]() {
+			JPG::StageTimes times;
+			JPG::JPGDecoder::DecodeStages(*contents, pixels.data(), contents->width * 3, options, times);
+			huffman.push_back(times.huffman);
+			idct.push_back(times.idct);
+			color.push_back(times.color);
+		});
+		add("huffman", Median(huffman));
+		add("idct", Median(idct));
+		add("color", Median(color));
+
+		// Only the YCbCr (or gray) -> RGB8 kernel, on every row of the image. The input is one row of random
+		// samples, like the rows that come out of the upsampling in the fused pipeline it is in the cache already.
+		const uint32_t width = contents->width;
+		std::vector<JPG::byte> samples(size_t(width) * 3);
+		uint32_t seed = 1;
+		for (JPG::byte& sample : samples) {
+			seed = seed * 1103515245 + 12345;
+			sample = JPG::byte(seed >> 16);
+		}
+		// levels without their own color conversion (AVX-512 uses the AVX2 one) are left out
+		JPG::YCbCrToRGBKernel previousKernel = nullptr;
+		for (const JPG::SIMDLevel level : { JPG::SIMDLevel::Scalar, JPG::SIMDLevel::SSE2, JPG::SIMDLevel::AVX2, JPG::SIMDLevel::AVX512 }) {
+			const JPG::Kernels& kernels = JPG::GetKernels(level);
+			if (level > JPG::DetectSIMDLevel() || kernels.ycbcrToRGB == previousKernel) {
+				continue;
+			}
+			previousKernel = kernels.ycbcrToRGB;
+			add(std::string("color_kernel_") + LevelName(level), Median(Repeat(settings.minSeconds, [&]() {
+				for (uint32_t y = 0; y < contents->height; y++) {
+					JPG::byte* row = pixels.data() + size_t(y) * width * 3;
+					if (contents->numComponents == 1) {
+						kernels.grayToRGB(samples.data(), row, width);
+					}
+					else {
+						kernels.ycbcrToRGB(samples.data(), samples.data() + width, samples.data() + 2 * width, row, width);
+					}
+				}
+			})));
+		}
+
+		// the reference IDCT is slow, one run is enough
+		options.idctMethod = JPG::IDCTMethod::Reference;
+		JPG::StageTimes times;
+		JPG::JPGDecoder::DecodeStages(*contents, pixels.data(), contents->width * 3, options, times);
+		add("idct_reference", times.idct);
+
+		const std::unique_ptr<JPG::MCU[]> mcus = JPG::JPGDecoder::DecodeJPG(*contents);
+		const std::string bmpFile = (fs::temp_directory_path() / "JPGBenchmark.bmp").string();
+		add("write_bmp", Median(Repeat(settings.minSeconds, [&]() {
+			JPG::JPGDecoder::WriteBMPFromJPG(*contents, mcus.get(), bmpFile);
+		})));
+		fs::remove(bmpFile);
+		return results;
+	}
+
+	DecodeResult BenchmarkDecode(const Image& image, const Settings& settings, JPG::Decoder& decoder) {
+		decoder.options.numThreads = settings.numThreads;
+		const double seconds = Median(Repeat(settings.minSeconds, [&]() {
+			decoder.Read(image.data.data(), image.data.size());
+			decoder.Decode();
+		}));
+		const JPG::JPGInfo info = JPG::JPGDecoder::ProbeJPG(image.data.data(), image.data.size());
+		DecodeResult result = { &image, info, seconds * 1000, double(info.width) * info.height / 1e6 / seconds, image.data.size() / 1e6 / seconds, {} };
+#if JPG_STATS
+		decoder.options.stats = &result.stats;
+		decoder.Read(image.data.data(), image.data.size());
+		decoder.Decode();
+		decoder.options.stats = nullptr;
+#endif
+		return result;
+	}
+
+#if JPG_STATS
+	// only libraries built with JPG_STATS count the statistics
+	void WriteStatsJSON(std::ostream& out, const JPG::DecodeStats& stats) {
+		uint64_t lastCoefficients = 0;
+		for (uint32_t i = 0; i < 64; i++) {
+			lastCoefficients += stats.blocksByLastCoefficient[i] * i;
+		}
+		out << ", \"stats\": { \"huffman_ms\": " << stats.times.huffman * 1000 << ", \"idct_ms\": " << stats.times.idct * 1000
+			<< ", \"color_ms\": " << stats.times.color * 1000 << ", \"entropy_bytes\": " << stats.entropyBytes << ", \"entropy_bits\": " << stats.entropyBits
+			<< ", \"symbols\": " << stats.symbols << ", \"restarts\": " << stats.restarts << ", \"blocks\": " << stats.blocks
+			<< ", \"mean_last_coefficient\": " << (stats.blocks != 0 ? double(lastCoefficients) / stats.blocks : 0.0) << ", \"zero_runs\": [";
+		for (uint32_t i = 0; i < 17; i++) {
+			out << (i != 0 ? ", " : "") << stats.zeroRuns[i];
+		}
+		out << "] }";
+	}
+#endif
+
+	void WriteJSON(std::ostream& out, const Settings& settings, const std::vector<StageResult>& stages, const std::vector<DecodeResult>& decodes) {
+		out << "{\n";
+		out << "  \"threads\": " << settings.numThreads << ",\n";
+		out << "  \"stages\": [\n";
+		for (size_t i = 0; i < stages.size(); i++) {
+			const StageResult& result = stages[i];
+			out << "    { \"image\": " << JSONString(result.image) << ", \"stage\": " << JSONString(result.stage)
+				<< ", \"ms\": " << result.milliseconds << ", \"megapixels_per_second\": " << result.megapixelsPerSecond << " }"
+				<< (i + 1 < stages.size() ? ",\n" : "\n");
+		}
+		out << "  ],\n";
+		out << "  \"decode\": [\n";
+		for (size_t i = 0; i < decodes.size(); i++) {
+			const DecodeResult& result = decodes[i];
+			const Image& image = *result.image;
+			out << "    { \"image\": " << JSONString(image.name) << ", \"width\": " << result.info.width << ", \"height\": " << result.info.height
+				<< ", \"components\": " << uint32_t(result.info.numComponents) << ", \"bytes\": " << image.data.size();
+			if (image.synthetic) {
+				out << ", \"quality\": " << image.encodeSettings.quality << ", \"sampling\": " << JSONString(SamplingName(image.encodeSettings))
+					<< ", \"restart_interval\": " << image.encodeSettings.restartInterval;
+			}
+			out << ", \"ms\": " << result.milliseconds << ", \"megapixels_per_second\": " << result.megapixelsPerSecond
+				<< ", \"megabytes_per_second\": " << result.megabytesPerSecond;
+#if JPG_STATS
+			WriteStatsJSON(out, result.stats);
+#endif
+			out << " }" << (i + 1 < decodes.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n";
+		out << "}\n";
+	}
+}
+
+int main(int argc, char** argv) {
+	try {
+		const Settings settings = ParseArguments(argc, argv);
+		if (!settings.corpusDir.empty()) {
+			fs::create_directories(settings.corpusDir);
+		}
+
+		std::vector<Image> files;
+		for (const std::string& fileName : settings.files) {
+			Image image;
+			image.name = fileName;
+			image.data = ReadFile(fileName);
+			files.push_back(std::move(image));
+		}
+
+		std::cout << "Stages (ms and MPixel/s, median)\n";
+		std::vector<Image> stageImages;
+		JPG::EncodeSettings encodeSettings;
+		encodeSettings.quality = 85;
+		stageImages.push_back(SyntheticJPG(1920, 1080, encodeSettings, settings));
+		encodeSettings.quality = 95;
+		encodeSettings.lumaHSF = encodeSettings.lumaVSF = 1;
+		stageImages.push_back(SyntheticJPG(1920, 1080, encodeSettings, settings));
+		encodeSettings.quality = 75;
+		encodeSettings.numComponents = 1;
+		stageImages.push_back(SyntheticJPG(1920, 1080, encodeSettings, settings));
+		stageImages.insert(stageImages.end(), files.begin(), files.end());
+
+		std::vector<StageResult> stages;
+		for (const Image& image : stageImages) {
+			const std::vector<StageResult> results = BenchmarkStages(image, settings);
+			std::cout << "  " << image.name << "\n   ";
+			for (const StageResult& result : results) {
+				std::cout << " " << result.stage << " " << result.milliseconds << " " << result.megapixelsPerSecond;
+			}
+			std::cout << std::endl;
+			stages.insert(stages.end(), results.begin(), results.end());
+		}
+
+		// every combination of size, quality, component layout and restart interval (none or one per MCU row)
+		const std::vector<std::pair<uint32_t, uint32_t>> sizes = settings.quick ?
+			std::vector<std::pair<uint32_t, uint32_t>>{ { 640, 480 }, { 1920, 1080 } } :
+			std::vector<std::pair<uint32_t, uint32_t>>{ { 640, 480 }, { 1920, 1080 }, { 4032, 3024 } };
+		const std::vector<uint32_t> qualities = settings.quick ? std::vector<uint32_t>{ 75, 95 } : std::vector<uint32_t>{ 50, 75, 90, 100 };
+		const JPG::EncodeSettings layouts[3] = { { 0, 1, 1, 1, 0 }, { 0, 3, 2, 2, 0 }, { 0, 3, 1, 1, 0 } };
+
+		std::vector<Image> corpus;
+		for (const auto& size : sizes) {
+			for (const uint32_t quality : qualities) {
+				for (const JPG::EncodeSettings& layout : layouts) {
+					for (const bool restart : { false, true }) {
+						JPG::EncodeSettings imageSettings = layout;
+						imageSettings.quality = quality;
+						imageSettings.restartInterval = restart ? (size.first + 8 * layout.lumaHSF - 1) / (8 * layout.lumaHSF) : 0;
+						corpus.push_back(SyntheticJPG(size.first, size.second, imageSettings, settings));
+					}
+				}
+			}
+		}
+		corpus.insert(corpus.end(), files.begin(), files.end());
+
+		std::cout << "Decode (ms, MPixel/s, MB/s)\n";
+		std::vector<DecodeResult> decodes;
+		JPG::Decoder decoder;
+		for (const Image& image : corpus) {
+			decodes.push_back(BenchmarkDecode(image, settings, decoder));
+			const DecodeResult& result = decodes.back();
+			std::cout << "  " << image.name << " " << result.milliseconds << " " << result.megapixelsPerSecond << " " << result.megabytesPerSecond << std::endl;
+		}
+
+		if (!settings.resultsFile.empty()) {
+			std::ofstream out(settings.resultsFile);
+			WriteJSON(out, settings, stages, decodes);
+			if (!out) {
+				throw std::runtime_error("Error - Cannot write " + settings.resultsFile);
+			}
+		}
+		else {
+			WriteJSON(std::cout, settings, stages, decodes);
+		}
+	}
+	catch (const std::exception& e) {
+		std::cout << e.what() << '\n';
+		return 1;
+	}
+	return 0;
+}
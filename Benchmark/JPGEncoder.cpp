@@ -0,0 +1,388 @@
+#include "JPGEncoder.hpp"
+#include <cmath>
+#include <random>
+#include <stdexcept>
+
+namespace JPG {
+	namespace {
+		// tables from annex K of the standard, quantization tables in natural order
+		const byte LuminanceQuantization[64] = {
+			16, 11, 10, 16, 24, 40, 51, 61,
+			12, 12, 14, 19, 26, 58, 60, 55,
+			14, 13, 16, 24, 40, 57, 69, 56,
+			14, 17, 22, 29, 51, 87, 80, 62,
+			18, 22, 37, 56, 68, 109, 103, 77,
+			24, 35, 55, 64, 81, 104, 113, 92,
+			49, 64, 78, 87, 103, 121, 120, 101,
+			72, 92, 95, 98, 112, 100, 103, 99
+		};
+		const byte ChrominanceQuantization[64] = {
+			17, 18, 24, 47, 99, 99, 99, 99,
+			18, 21, 26, 66, 99, 99, 99, 99,
+			24, 26, 56, 99, 99, 99, 99, 99,
+			47, 66, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99,
+			99, 99, 99, 99, 99, 99, 99, 99
+		};
+
+		const byte LuminanceDCLengths[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+		const byte ChrominanceDCLengths[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+		const byte DCSymbols[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+		const byte LuminanceACLengths[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+		const byte LuminanceACSymbols[162] = {
+			0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+			0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+			0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+			0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+			0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+			0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+			0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+			0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+			0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+			0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+			0xf9, 0xfa
+		};
+		const byte ChrominanceACLengths[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+		const byte ChrominanceACSymbols[162] = {
+			0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+			0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+			0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+			0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+			0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+			0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+			0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+			0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+			0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+			0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+			0xf9, 0xfa
+		};
+
+		// code and length of every symbol of a table given as code lengths and symbols (like a DHT marker)
+		struct HuffmanCodes {
+			uint16_t codes[256] = { 0 };
+			byte lengths[256] = { 0 };
+
+			HuffmanCodes(const byte numCodes[16], const byte* symbols) {
+				uint code = 0;
+				uint k = 0;
+				for (uint i = 0; i < 16; i++) {
+					for (uint j = 0; j < numCodes[i]; j++, k++) {
+						codes[symbols[k]] = uint16_t(code++);
+						lengths[symbols[k]] = byte(i + 1);
+					}
+					code <<= 1;
+				}
+			}
+		};
+
+		class BitWriter {
+			std::vector<byte>& output;
+			uint32_t buffer = 0;
+			uint numBits = 0;
+		public:
+			explicit BitWriter(std::vector<byte>& output) : output(output) {}
+
+			void write(const uint bits, const uint length) {
+				buffer = (buffer << length) | (bits & ((1u << length) - 1));
+				numBits += length;
+				while (numBits >= 8) {
+					const byte value = byte(buffer >> (numBits - 8));
+					output.push_back(value);
+					if (value == 0xFF) {
+						output.push_back(0);
+					}
+					numBits -= 8;
+				}
+			}
+
+			// pads the last byte with 1 bits
+			void flush() {
+				if (numBits != 0) {
+					write(0x7F, 8 - numBits);
+				}
+			}
+		};
+
+		void WriteMarker(std::vector<byte>& output, const byte marker, const uint length) {
+			output.push_back(0xFF);
+			output.push_back(marker);
+			output.push_back(byte(length >> 8));
+			output.push_back(byte(length & 0xFF));
+		}
+
+		void WriteHuffmanTable(std::vector<byte>& output, const byte tableClassAndID, const byte numCodes[16], const byte* symbols) {
+			uint numSymbols = 0;
+			for (uint i = 0; i < 16; i++) {
+				numSymbols += numCodes[i];
+			}
+			WriteMarker(output, DHT, 2 + 1 + 16 + numSymbols);
+			output.push_back(tableClassAndID);
+			output.insert(output.end(), numCodes, numCodes + 16);
+			output.insert(output.end(), symbols, symbols + numSymbols);
+		}
+
+		// number of bits of the magnitude category of a coefficient
+		uint Category(int value) {
+			value = std::abs(value);
+			uint length = 0;
+			while (value != 0) {
+				length++;
+				value >>= 1;
+			}
+			return length;
+		}
+
+		// forward DCT of samples centered around 0, quantized and in zigzag order
+		void ForwardDCT(const float samples[64], const uint16_t quantization[64], int output[64]) {
+			struct Cosines {
+				float table[8][8];
+				Cosines() {
+					for (uint u = 0; u < 8; u++) {
+						for (uint x = 0; x < 8; x++) {
+							table[u][x] = (u == 0 ? std::sqrt(0.125f) : 0.5f) * std::cos((2 * x + 1) * u * 3.14159265f / 16);
+						}
+					}
+				}
+			};
+			static const Cosines cosineTable;
+			const auto& cosines = cosineTable.table;
+			float rows[64];
+			for (uint y = 0; y < 8; y++) {
+				for (uint u = 0; u < 8; u++) {
+					float sum = 0;
+					for (uint x = 0; x < 8; x++) {
+						sum += cosines[u][x] * samples[y * 8 + x];
+					}
+					rows[y * 8 + u] = sum;
+				}
+			}
+			for (uint i = 0; i < 64; i++) {
+				const uint u = MCUMap[i] % 8;
+				const uint v = MCUMap[i] / 8;
+				float sum = 0;
+				for (uint y = 0; y < 8; y++) {
+					sum += cosines[v][y] * rows[y * 8 + u];
+				}
+				output[i] = int(std::lround(sum / quantization[MCUMap[i]]));
+			}
+		}
+	}
+
+	std::vector<byte> EncodeJPG(const byte* pixels, const uint width, const uint height, const EncodeSettings& settings) {
+		if (width == 0 || height == 0 || width > 0xFFFF || height > 0xFFFF) {
+			throw std::invalid_argument("Error - Unsupported image size");
+		}
+		if (settings.numComponents != 1 && settings.numComponents != 3) {
+			throw std::invalid_argument("Error - Only 1 or 3 components can be encoded");
+		}
+		const uint numComponents = settings.numComponents;
+		const uint maxHSF = numComponents == 1 ? 1 : settings.lumaHSF;
+		const uint maxVSF = numComponents == 1 ? 1 : settings.lumaVSF;
+
+		// libjpeg's quality scaling
+		const uint quality = std::min(std::max(settings.quality, 1u), 100u);
+		const uint scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+		uint16_t quantization[2][64];
+		for (uint i = 0; i < 64; i++) {
+			quantization[0][i] = uint16_t(std::min(std::max((LuminanceQuantization[i] * scale + 50) / 100, 1u), 255u));
+			quantization[1][i] = uint16_t(std::min(std::max((ChrominanceQuantization[i] * scale + 50) / 100, 1u), 255u));
+		}
+
+		// full resolution YCbCr planes, padded to whole MCUs by repeating the edge pixels
+		const uint mcuWidth = (width + 8 * maxHSF - 1) / (8 * maxHSF);
+		const uint mcuHeight = (height + 8 * maxVSF - 1) / (8 * maxVSF);
+		const uint paddedWidth = mcuWidth * 8 * maxHSF;
+		const uint paddedHeight = mcuHeight * 8 * maxVSF;
+		std::vector<float> planes[3];
+		for (uint j = 0; j < numComponents; j++) {
+			planes[j].resize(size_t(paddedWidth) * paddedHeight);
+		}
+		for (uint y = 0; y < paddedHeight; y++) {
+			for (uint x = 0; x < paddedWidth; x++) {
+				const size_t i = size_t(y) * paddedWidth + x;
+				const byte* pixel = pixels + (size_t(std::min(y, height - 1)) * width + std::min(x, width - 1)) * 3;
+				const float r = pixel[0];
+				const float g = pixel[1];
+				const float b = pixel[2];
+				planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b - 128;
+				if (numComponents == 1) {
+					continue;
+				}
+				planes[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b;
+				planes[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b;
+			}
+		}
+
+		std::vector<byte> output = { 0xFF, SOI };
+		WriteMarker(output, APP0, 16);
+		const byte jfif[] = { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+		output.insert(output.end(), jfif, jfif + sizeof(jfif));
+
+		for (uint t = 0; t < (numComponents == 1 ? 1u : 2u); t++) {
+			WriteMarker(output, DQT, 2 + 1 + 64);
+			output.push_back(byte(t));
+			for (uint i = 0; i < 64; i++) {
+				output.push_back(byte(quantization[t][MCUMap[i]]));
+			}
+		}
+
+		WriteMarker(output, SOF0, 2 + 6 + numComponents * 3);
+		output.push_back(8);
+		output.push_back(byte(height >> 8));
+		output.push_back(byte(height & 0xFF));
+		output.push_back(byte(width >> 8));
+		output.push_back(byte(width & 0xFF));
+		output.push_back(byte(numComponents));
+		for (uint j = 0; j < numComponents; j++) {
+			output.push_back(byte(j + 1));
+			output.push_back(byte(j == 0 ? (maxHSF << 4) | maxVSF : 0x11));
+			output.push_back(byte(j == 0 ? 0 : 1));
+		}
+
+		WriteHuffmanTable(output, 0x00, LuminanceDCLengths, DCSymbols);
+		WriteHuffmanTable(output, 0x10, LuminanceACLengths, LuminanceACSymbols);
+		if (numComponents == 3) {
+			WriteHuffmanTable(output, 0x01, ChrominanceDCLengths, DCSymbols);
+			WriteHuffmanTable(output, 0x11, ChrominanceACLengths, ChrominanceACSymbols);
+		}
+
+		if (settings.restartInterval != 0) {
+			WriteMarker(output, DRI, 4);
+			output.push_back(byte(settings.restartInterval >> 8));
+			output.push_back(byte(settings.restartInterval & 0xFF));
+		}
+
+		WriteMarker(output, SOS, 2 + 1 + numComponents * 2 + 3);
+		output.push_back(byte(numComponents));
+		for (uint j = 0; j < numComponents; j++) {
+			output.push_back(byte(j + 1));
+			output.push_back(byte(j == 0 ? 0x00 : 0x11));
+		}
+		output.push_back(0);
+		output.push_back(63);
+		output.push_back(0);
+
+		const HuffmanCodes dcCodes[2] = { HuffmanCodes(LuminanceDCLengths, DCSymbols), HuffmanCodes(ChrominanceDCLengths, DCSymbols) };
+		const HuffmanCodes acCodes[2] = { HuffmanCodes(LuminanceACLengths, LuminanceACSymbols), HuffmanCodes(ChrominanceACLengths, ChrominanceACSymbols) };
+		BitWriter bits(output);
+		int prevDC[3] = { 0 };
+		auto encodeBlock = [&](const uint j, const float samples[64]) {
+			const uint table = j == 0 ? 0 : 1;
+			int coefficients[64];
+			ForwardDCT(samples, quantization[table], coefficients);
+
+			const int difference = coefficients[0] - prevDC[j];
+			prevDC[j] = coefficients[0];
+			uint length = Category(difference);
+			bits.write(dcCodes[table].codes[length], dcCodes[table].lengths[length]);
+			bits.write(difference < 0 ? difference - 1 : difference, length);
+
+			uint zeros = 0;
+			for (uint i = 1; i < 64; i++) {
+				if (coefficients[i] == 0) {
+					zeros++;
+					continue;
+				}
+				for (; zeros >= 16; zeros -= 16) {
+					bits.write(acCodes[table].codes[0xF0], acCodes[table].lengths[0xF0]);
+				}
+				length = Category(coefficients[i]);
+				const uint symbol = (zeros << 4) | length;
+				bits.write(acCodes[table].codes[symbol], acCodes[table].lengths[symbol]);
+				bits.write(coefficients[i] < 0 ? coefficients[i] - 1 : coefficients[i], length);
+				zeros = 0;
+			}
+			if (zeros != 0) {
+				bits.write(acCodes[table].codes[0x00], acCodes[table].lengths[0x00]);
+			}
+		};
+
+		const uint numMCUs = mcuWidth * mcuHeight;
+		for (uint i = 0; i < numMCUs; i++) {
+			if (settings.restartInterval != 0 && i != 0 && i % settings.restartInterval == 0) {
+				bits.flush();
+				output.push_back(0xFF);
+				output.push_back(byte(RST0 + ((i / settings.restartInterval - 1) & 7)));
+				prevDC[0] = prevDC[1] = prevDC[2] = 0;
+			}
+			const uint mcuX = i % mcuWidth;
+			const uint mcuY = i / mcuWidth;
+			for (uint j = 0; j < numComponents; j++) {
+				// chroma blocks average the maxHSF x maxVSF pixels they cover
+				const uint hsf = j == 0 ? maxHSF : 1;
+				const uint vsf = j == 0 ? maxVSF : 1;
+				const uint h = maxHSF / hsf;
+				const uint v = maxVSF / vsf;
+				for (uint by = 0; by < vsf; by++) {
+					for (uint bx = 0; bx < hsf; bx++) {
+						float samples[64];
+						for (uint y = 0; y < 8; y++) {
+							for (uint x = 0; x < 8; x++) {
+								const uint px = mcuX * 8 * maxHSF + (bx * 8 + x) * h;
+								const uint py = mcuY * 8 * maxVSF + (by * 8 + y) * v;
+								float sum = 0;
+								for (uint dy = 0; dy < v; dy++) {
+									for (uint dx = 0; dx < h; dx++) {
+										sum += planes[j][size_t(py + dy) * paddedWidth + px + dx];
+									}
+								}
+								samples[y * 8 + x] = sum / (h * v);
+							}
+						}
+						encodeBlock(j, samples);
+					}
+				}
+			}
+		}
+		bits.flush();
+		output.push_back(0xFF);
+		output.push_back(EOI);
+		return output;
+	}
+
+	std::vector<byte> SyntheticImage(const uint width, const uint height, const uint seed) {
+		std::mt19937 random(seed);
+		std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+		// a few overlapping gradients and rectangles with hard edges on top of noise
+		struct Shape {
+			float x0, y0, x1, y1;
+			float color[3];
+		};
+		Shape shapes[12];
+		for (Shape& shape : shapes) {
+			const float x = uniform(random) * width;
+			const float y = uniform(random) * height;
+			shape = { x, y, x + uniform(random) * width / 2, y + uniform(random) * height / 2, { uniform(random) * 255, uniform(random) * 255, uniform(random) * 255 } };
+		}
+		const float frequency = 0.5f + uniform(random) * 4;
+
+		std::vector<byte> pixels(size_t(width) * height * 3);
+		std::uniform_int_distribution<int> noise(-12, 12);
+		for (uint y = 0; y < height; y++) {
+			for (uint x = 0; x < width; x++) {
+				const float u = float(x) / width;
+				const float v = float(y) / height;
+				float color[3] = {
+					255 * u,
+					255 * v,
+					127.5f + 127.5f * std::sin(frequency * 6.2831853f * (u + v))
+				};
+				for (const Shape& shape : shapes) {
+					if (x >= shape.x0 && x < shape.x1 && y >= shape.y0 && y < shape.y1) {
+						for (uint c = 0; c < 3; c++) {
+							color[c] = (color[c] + shape.color[c]) / 2;
+						}
+					}
+				}
+				byte* pixel = &pixels[(size_t(y) * width + x) * 3];
+				for (uint c = 0; c < 3; c++) {
+					pixel[c] = byte(std::min(std::max(int(color[c]) + noise(random), 0), 255));
+				}
+			}
+		}
+		return pixels;
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "JPGDecoder.hpp"
+
+namespace JPG {
+	// A small baseline encoder (standard huffman tables, float DCT) that makes the synthetic JPGs of the benchmark
+	// corpus. It is only good enough to produce realistic bitstreams, not small or pretty files.
+	struct EncodeSettings {
+		uint quality = 75; // 1 - 100, scales the quantization tables like libjpeg
+		uint numComponents = 3; // 1 = gray, 3 = YCbCr
+		uint lumaHSF = 2; // sampling factors of Y, the chroma components are 1x1 (2x2 = 4:2:0, 2x1 = 4:2:2, 1x1 = 4:4:4)
+		uint lumaVSF = 2;
+		uint restartInterval = 0; // MCUs between restart markers (0 = none)
+	};
+
+	// encodes width x height RGB8 pixels, a single component keeps only their luma
+	std::vector<byte> EncodeJPG(const byte* pixels, const uint width, const uint height, const EncodeSettings& settings);
+
+	// RGB8 test image with smooth gradients, hard edges and noise, the same for the same seed
+	std::vector<byte> SyntheticImage(const uint width, const uint height, const uint seed);
+}
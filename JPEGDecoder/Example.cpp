@@ -1,4 +1,5 @@
 #include "JPGDecoder.hpp"
+#include "ImageWriter.hpp"
 #include <stdexcept>
 #include <iostream>
 
@@ -6,9 +7,8 @@ int main() {
 	try {
 		auto contents = JPG::JPGDecoder::ReadJPG("plswork.jpg");
 
-		std::unique_ptr<JPG::MCU[]> mcus = JPG::JPGDecoder::DecodeJPG(*contents);
-
-		JPG::JPGDecoder::WriteBMPFromJPG(*contents, mcus.get(), "test.bmp");
+		// rows are written to the file while the image is decoded
+		JPG::ImageWriter::WriteJPG(*contents, "test.bmp", JPG::ImageFormat::BMP);
 	}
 	catch (const std::logic_error& e) {
 		std::cout << "Logic Error - " << e.what() << '\n';
@@ -0,0 +1,175 @@
+#include "ImageWriter.hpp"
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+#include <stdexcept>
+
+namespace JPG {
+	// rows are collected until about this many bytes are waiting
+	static const size_t WriteBufferSize = 1 << 20;
+
+	// offsets of red, green and blue in a pixel
+	struct ChannelOffsets {
+		uint red;
+		uint green;
+		uint blue;
+	};
+
+	static ChannelOffsets GetChannelOffsets(const PixelFormat format) {
+		switch (format) {
+		case PixelFormat::BGR8:
+			return { 2, 1, 0 };
+		case PixelFormat::Gray8:
+			return { 0, 0, 0 };
+		default:
+			return { 0, 1, 2 };
+		}
+	}
+
+	// converts width pixels from one pixel format into another, the output is RGB8, BGR8 or the input format
+	static void ConvertRow(const byte* input, const PixelFormat inputFormat, const uint width, byte* output, const PixelFormat outputFormat) {
+		if (inputFormat == outputFormat) {
+			std::memcpy(output, input, size_t(width) * JPGDecoder::BytesPerPixel(inputFormat));
+			return;
+		}
+		const uint bpp = JPGDecoder::BytesPerPixel(inputFormat);
+		const ChannelOffsets in = GetChannelOffsets(inputFormat);
+		const ChannelOffsets out = GetChannelOffsets(outputFormat);
+		for (uint x = 0; x < width; x++, input += bpp, output += 3) {
+			output[out.red] = input[in.red];
+			output[out.green] = input[in.green];
+			output[out.blue] = input[in.blue];
+		}
+	}
+
+	static void WriteLE(byte*& header, const uint value, const uint numBytes) {
+		for (uint i = 0; i < numBytes; i++) {
+			*header++ = (value >> (i * 8)) & 0xFF;
+		}
+	}
+
+	ImageWriter::ImageWriter(const std::string& fileName, const ImageFormat format, const uint width, const uint height, const PixelFormat pixelFormat)
+		: format(format), width(width), height(height), pixelFormat(pixelFormat), filePixelFormat(FilePixelFormat(format, pixelFormat)) {
+		if (format == ImageFormat::BMP && (width > 0xFFFF || height > 0xFFFF)) {
+			throw std::length_error("Error - Image is too large for a BMP file");
+		}
+		out.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!out) {
+			throw std::invalid_argument("Error - Cannot open file for writing! (Is the filename correct?)");
+		}
+
+		rowSize = size_t(width) * JPGDecoder::BytesPerPixel(filePixelFormat);
+		byte header[32];
+		byte* end = header;
+		if (format == ImageFormat::BMP) {
+			// BMP rows are padded to a multiple of 4 bytes
+			rowSize = (rowSize + 3) & ~size_t(3);
+			headerSize = 14 + 12;
+			*end++ = 'B';
+			*end++ = 'M';
+			WriteLE(end, uint(headerSize + rowSize * height), 4);
+			WriteLE(end, 0, 4);
+			WriteLE(end, uint(headerSize), 4);
+			WriteLE(end, 12, 4);
+			WriteLE(end, width, 2);
+			WriteLE(end, height, 2);
+			WriteLE(end, 1, 2);
+			WriteLE(end, 24, 2);
+		}
+		else if (format == ImageFormat::PPM) {
+			end += std::snprintf(reinterpret_cast<char*>(header), sizeof(header), "P%c\n%u %u\n255\n", filePixelFormat == PixelFormat::Gray8 ? '5' : '6', width, height);
+			headerSize = end - header;
+		}
+		out.write(reinterpret_cast<const char*>(header), headerSize);
+
+		bufferRows = uint(std::max<size_t>(1, std::min<size_t>(height, WriteBufferSize / std::max<size_t>(rowSize, 1))));
+		buffer.resize(bufferRows * rowSize);
+	}
+
+	ImageWriter::~ImageWriter() {
+		try {
+			Flush();
+		}
+		catch (...) {
+		}
+	}
+
+	PixelFormat ImageWriter::FilePixelFormat(const ImageFormat format, const PixelFormat pixelFormat) {
+		switch (format) {
+		case ImageFormat::BMP:
+			return PixelFormat::BGR8;
+		case ImageFormat::PPM:
+			return pixelFormat == PixelFormat::Gray8 ? PixelFormat::Gray8 : PixelFormat::RGB8;
+		default:
+			return pixelFormat;
+		}
+	}
+
+	size_t ImageWriter::FileOffset(const uint row) const {
+		return headerSize + size_t(format == ImageFormat::BMP ? height - 1 - row : row) * rowSize;
+	}
+
+	void ImageWriter::WriteRow(const uint row, const byte* pixels) {
+		if (row >= height) {
+			throw std::out_of_range("Error - Row is outside of the image");
+		}
+		if (numRows == bufferRows || (numRows != 0 && row != firstRow + numRows)) {
+			Flush();
+		}
+		if (numRows == 0) {
+			firstRow = row;
+		}
+		const uint slot = format == ImageFormat::BMP ? bufferRows - 1 - numRows : numRows;
+		byte* output = &buffer[slot * rowSize];
+		ConvertRow(pixels, pixelFormat, width, output, filePixelFormat);
+		const size_t pixelBytes = size_t(width) * JPGDecoder::BytesPerPixel(filePixelFormat);
+		std::memset(output + pixelBytes, 0, rowSize - pixelBytes);
+		numRows++;
+	}
+
+	void ImageWriter::WriteImage(const byte* pixels, const size_t stride) {
+		// rows that are stored as they are go out in one call
+		if (format != ImageFormat::BMP && pixelFormat == filePixelFormat && stride == rowSize) {
+			Flush();
+			out.seekp(headerSize);
+			out.write(reinterpret_cast<const char*>(pixels), rowSize * height);
+			return;
+		}
+		for (uint row = 0; row < height; row++) {
+			WriteRow(row, pixels + row * stride);
+		}
+	}
+
+	RowCallback ImageWriter::RowWriter() {
+		return [this](uint row, const byte* pixels) {
+			WriteRow(row, pixels);
+		};
+	}
+
+	void ImageWriter::Flush() {
+		if (numRows == 0) {
+			return;
+		}
+		const uint slot = format == ImageFormat::BMP ? bufferRows - numRows : 0;
+		const uint fileRow = format == ImageFormat::BMP ? firstRow + numRows - 1 : firstRow;
+		out.seekp(FileOffset(fileRow));
+		out.write(reinterpret_cast<const char*>(&buffer[slot * rowSize]), numRows * rowSize);
+		numRows = 0;
+	}
+
+	void ImageWriter::Close() {
+		Flush();
+		out.close();
+		if (!out) {
+			throw std::runtime_error("Error - Cannot write file");
+		}
+	}
+
+	void ImageWriter::WriteJPG(JPGFile& contents, const std::string& fileName, const ImageFormat format, DecodeOptions options) {
+		options.pixelFormat = FilePixelFormat(format, options.pixelFormat);
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		ImageWriter writer(fileName, format, contents.outputWidth, contents.outputHeight, options.pixelFormat);
+		JPGDecoder::DecodeJPGRows(contents, writer.RowWriter(), options);
+		writer.Close();
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include "JPGDecoder.hpp"
+
+namespace JPG {
+	enum class ImageFormat {
+		BMP, // 24 bit, bottom up
+		PPM, // binary P6, or P5 for Gray8 pixels
+		Raw  // the pixels as they are, without a header
+	};
+
+	// Writes an image file row by row. Rows are converted into a buffer of many rows that is written with one
+	// call, rows may arrive in any order but consecutive rows from top to bottom (like DecodeJPGRows gives
+	// them) are the fast path. The file is complete after Close.
+	class ImageWriter {
+	public:
+		ImageWriter(const std::string& fileName, const ImageFormat format, const uint width, const uint height, const PixelFormat pixelFormat);
+		~ImageWriter();
+		ImageWriter(const ImageWriter&) = delete;
+		ImageWriter& operator=(const ImageWriter&) = delete;
+
+		// writes row (0 = top) of width pixels in pixelFormat
+		void WriteRow(const uint row, const byte* pixels);
+		// writes height rows that are stride bytes apart
+		void WriteImage(const byte* pixels, const size_t stride);
+		// callback for DecodeJPGRows that writes every decoded row, the writer has to outlive the decode
+		RowCallback RowWriter();
+		// writes the buffered rows and throws if the file could not be written
+		void Close();
+
+		// pixel format that is stored without conversion, the best one to decode into
+		static PixelFormat FilePixelFormat(const ImageFormat format, const PixelFormat pixelFormat);
+		// decodes contents straight into the file, only a few rows are in memory at a time
+		static void WriteJPG(JPGFile& contents, const std::string& fileName, const ImageFormat format, DecodeOptions options = DecodeOptions());
+	private:
+		void Flush();
+		size_t FileOffset(const uint row) const;
+	private:
+		std::ofstream out;
+		ImageFormat format;
+		uint width;
+		uint height;
+		PixelFormat pixelFormat;
+		PixelFormat filePixelFormat;
+		size_t rowSize = 0; // bytes of a row in the file including padding
+		size_t headerSize = 0;
+
+		// consecutive rows waiting to be written, BMP rows are stored from the end of the buffer as the file is bottom up
+		std::vector<byte> buffer;
+		uint bufferRows = 0;
+		uint firstRow = 0;
+		uint numRows = 0;
+	};
+}
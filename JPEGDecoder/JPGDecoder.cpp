@@ -1,9 +1,20 @@
 #include "JPGDecoder.hpp"
-#include <iostream>
-#define NOMINMAX
-#include <Windows.h>
+#include "JPGKernels.hpp"
+#include "ThreadPool.hpp"
+#include "ImageWriter.hpp"
+#include <cstring>
 #include <algorithm>
 #include <cmath>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace JPG {
 
@@ -13,174 +24,323 @@ namespace JPG {
 
 
 
+	// Reads the marker segments in front of the entropy coded data. Like an input stream it returns 0xFF
+	// past the end of the data and remembers that it ran out.
+	class ByteReader {
+		const byte* start;
+		const byte* position;
+		const byte* end;
+		bool overrun = false;
+	public:
+		ByteReader(const byte* data, const size_t size) :
+			start(data),
+			position(data),
+			end(data + size)
+		{}
+
+		byte get() {
+			if (position == end) {
+				overrun = true;
+				return 0xFF;
+			}
+			return *position++;
+		}
+
+		uint getShort() {
+			const uint high = get();
+			return (high << 8) + get();
+		}
+
+		void skip(const size_t length) {
+			if (length > size_t(end - position)) {
+				overrun = true;
+				position = end;
+				return;
+			}
+			position += length;
+		}
+
+		// offset of the next byte from the start of the data
+		size_t offset() const {
+			return position - start;
+		}
+
+		void seek(const size_t offset) {
+			position = start + offset;
+		}
+
+		explicit operator bool() const {
+			return !overrun;
+		}
+	};
+
 	std::unique_ptr<JPGFile> JPGDecoder::ReadJPG(const std::string & filename) {
+#ifdef __linux__
+		// map the file instead of reading it, the huffman coded data is decoded straight from the page cache
+		const int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::invalid_argument("Error - Cannot open file! (Is the filename correct?)");
+		}
+		struct stat status;
+		if (fstat(fd, &status) != 0 || status.st_size == 0) {
+			close(fd);
+			throw std::invalid_argument("Error - Invalid JPG file (file is empty or cannot be read)");
+		}
+		const size_t size = size_t(status.st_size);
+		void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			throw std::invalid_argument("Error - Cannot map file into memory");
+		}
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		std::shared_ptr<const byte> fileData(static_cast<const byte*>(mapping), [size](const byte* data) {
+			munmap(const_cast<byte*>(data), size);
+		});
+#else
 		// open file
-		std::ifstream file(filename, std::ios::in | std::ios::binary);
+		std::ifstream file(filename, std::ios::in | std::ios::binary | std::ios::ate);
 
 		if (!file.is_open()) {
 			throw std::invalid_argument("Error - Cannot open file! (Is the filename correct?)");
 		}
 
-		std::unique_ptr<JPGFile> jpgContents = std::make_unique<JPGFile>();
+		const size_t size = size_t(file.tellg());
+		std::shared_ptr<byte> buffer(new byte[size], std::default_delete<byte[]>());
+		file.seekg(0);
+		file.read(reinterpret_cast<char*>(buffer.get()), size);
+		if (!file) {
+			throw std::invalid_argument("Error - Cannot read file");
+		}
+		std::shared_ptr<const byte> fileData = buffer;
+#endif
 
-		byte markerFF = file.get();
-		byte markerID = file.get();
+		std::unique_ptr<JPGFile> jpgContents = ReadJPG(fileData.get(), size);
+		jpgContents->fileData = std::move(fileData);
+		return jpgContents;
+	}
 
-		if (markerFF != 0xFF || markerID != SOI) {
-			file.close();
-			throw std::invalid_argument("Error - Invalid JPG file (markerFF is not FF or markerID is not SOI at the beginnning)");
-		}
-		markerFF = file.get();
-		markerID = file.get();
+	std::unique_ptr<JPGFile> JPGDecoder::ReadJPG(const byte* data, const size_t size) {
+		std::unique_ptr<JPGFile> jpgContents = std::make_unique<JPGFile>();
+		ReadJPG(data, size, *jpgContents);
+		return jpgContents;
+	}
 
-		while (true) {
+	// starts from scratch, but keeps the memory of the vectors
+	void ClearJPGFile(JPGFile& contents) {
+		std::vector<size_t> restartOffsets = std::move(contents.restartOffsets);
+		std::vector<Scan> scans = std::move(contents.scans);
+		ComponentPlane planes[3] = { std::move(contents.planes[0]), std::move(contents.planes[1]), std::move(contents.planes[2]) };
+		contents = JPGFile();
+		restartOffsets.clear();
+		scans.clear();
+		contents.restartOffsets = std::move(restartOffsets);
+		contents.scans = std::move(scans);
+		for (uint j = 0; j < 3; j++) {
+			contents.planes[j] = std::move(planes[j]);
+		}
+	}
 
-			if (markerFF != 0xFF) {
-				throw std::invalid_argument("Error - Invalid JPG file (markerFF is not 0xFF)");
+	// where the entropy coded data of a progressive scan that starts at offset ends: at the first marker that is not a
+	// RST marker (bitstream.size or more if there is none yet)
+	size_t ScanEnd(const ByteSpan& bitstream, const size_t offset) {
+		size_t scanEnd = offset;
+		while (scanEnd < bitstream.size) {
+			const byte* next = static_cast<const byte*>(std::memchr(bitstream.data + scanEnd, 0xFF, bitstream.size - scanEnd));
+			scanEnd = next == nullptr ? bitstream.size : next - bitstream.data;
+			size_t markerEnd = scanEnd + 1;
+			while (markerEnd < bitstream.size && bitstream.data[markerEnd] == 0xFF) {
+				markerEnd++;
 			}
-			if (!file) {
-				throw std::invalid_argument("Error - Invalid JPG File (File ended without reaching EOF marker)");
+			if (markerEnd < bitstream.size && bitstream.data[markerEnd] != 0x00 && (bitstream.data[markerEnd] < RST0 || bitstream.data[markerEnd] > RST7)) {
+				break;
 			}
+			scanEnd = markerEnd + 1;
+		}
+		return scanEnd;
+	}
 
-			if (markerID >= APP0 && markerID <= APP15) {
-				ProcessAPPN(file, *jpgContents);
-			}
-			else if (markerID == COM) {
-				ProcessComment(file, *jpgContents);
-			}
-			else if (markerID == DRI) {
-				ProcessRestartInterval(file, *jpgContents);
-			}
-			else if (markerID == DQT) {
-				ProcessQuantizationTable(file, *jpgContents);
+	bool JPGDecoder::ProcessSegment(const byte markerID, ByteReader& reader, JPGFile& jpgContents) {
+		if (markerID >= APP0 && markerID <= APP15) {
+			ProcessAPPN(reader, jpgContents);
+		}
+		else if (markerID == COM) {
+			ProcessComment(reader, jpgContents);
+		}
+		else if (markerID == DRI) {
+			ProcessRestartInterval(reader, jpgContents);
+		}
+		else if (markerID == DQT) {
+			ProcessQuantizationTable(reader, jpgContents);
+		}
+		else if (markerID == DHT) {
+			ProcessHuffmanTable(reader, jpgContents);
+		}
+		else if (markerID == SOF0 || markerID == SOF2) {
+			if (jpgContents.numComponents == 0) {
+				jpgContents.sofType = markerID;
 			}
-			else if (markerID == DHT) {
-				ProcessHuffmanTable(file, *jpgContents);
+			ProcessStartOfFrame(reader, jpgContents);
+		}
+		else {
+			return false;
+		}
+		return true;
+	}
+
+	void JPGDecoder::CheckComponents(const JPGFile& jpgContents) {
+		if (jpgContents.numComponents != 1 && jpgContents.numComponents != 3) {
+			throw std::length_error("Error - Invalid JPG (Unsupported NumComponents)");
+		}
+
+		for (uint i = 0; i < jpgContents.numComponents; i++) {
+			if (jpgContents.qtTables[jpgContents.components[i].quantizationTableID].set == false) {
+				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized qTable)");
 			}
-			else if (markerID == SOF0) {
-				ProcessStartOfFrame(file, *jpgContents);
+			// the tables of progressive scans are checked with each scan
+			if (jpgContents.sofType == SOF2) {
+				continue;
 			}
-			else if (markerID == SOS) {
-				ProccesStartOfScan(file, *jpgContents);
-				break;
+			if (jpgContents.huffmanACTables[jpgContents.components[i].huffmanACTableID].set == false) {
+				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized AC Table)");
 			}
-			else if (markerID == 0xFF) {
-				markerID = file.get();
-				continue;
+			if (jpgContents.huffmanDCTables[jpgContents.components[i].huffmanDCTableID].set == false) {
+				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized DC Table)");
 			}
-
-			// TODO: Add handlers for unused / error markers.
-			markerFF = file.get();
-			markerID = file.get();
 		}
+	}
 
-		markerID = file.get();
+	void JPGDecoder::ReadJPG(const byte* data, const size_t size, JPGFile& contents) {
+		ByteReader reader(data, size);
+		ClearJPGFile(contents);
+		JPGFile* jpgContents = &contents;
 
-		// read huffman coded bitstream
-		while (true) {
-			if (!file) {
-				throw std::invalid_argument("Error - Invalid JPG File (File ended without reaching EOF marker in HCB)");
-			}
+		byte markerFF = reader.get();
+		byte markerID = reader.get();
+
+		if (markerFF != 0xFF || markerID != SOI) {
+			throw std::invalid_argument("Error - Invalid JPG file (markerFF is not FF or markerID is not SOI at the beginnning)");
+		}
+		markerFF = reader.get();
+		markerID = reader.get();
 
-			markerFF = markerID;
-			markerID = file.get();
+		size_t dataStart = 0;
+		while (true) {
 
-			if (markerFF == 0xFF) {
-				if (markerID == EOI) {
+			if (markerFF != 0xFF) {
+				throw std::invalid_argument("Error - Invalid JPG file (markerFF is not 0xFF)");
+			}
+			if (!reader) {
+				if (!jpgContents->scans.empty()) {
+					jpgContents->truncated = true;
 					break;
 				}
-				else if (markerID == 0x00) {
-					jpgContents->huffmanBitstream.push_back(markerFF);
-					markerID = file.get();
-				}
-				else if (markerID >= RST0 && markerID <= RST7) {
-					markerID = file.get();
+				throw std::invalid_argument("Error - Invalid JPG File (File ended without reaching EOF marker)");
+			}
+
+			if (markerID == SOS) {
+				ProccesStartOfScan(reader, *jpgContents);
+				if (jpgContents->sofType != SOF2) {
+					break;
 				}
-				else if (markerID == 0xFF) {
-					continue;
+
+				// progressive JPGs have tables and more scans after each scan, huffmanBitstream is the rest of the
+				// file and the markers after each scan are read from it again
+				if (jpgContents->huffmanBitstream.data == nullptr) {
+					dataStart = reader.offset();
+					jpgContents->huffmanBitstream = { data + dataStart, size - dataStart };
 				}
-				else {
-					throw std::invalid_argument("Error - Invalid JPG File (Unknown marker at HCB)");
+				const ByteSpan bitstream = jpgContents->huffmanBitstream;
+				Scan& scan = jpgContents->scans.back();
+				scan.offset = reader.offset() - dataStart;
+
+				const size_t scanEnd = ScanEnd(bitstream, scan.offset);
+				if (scanEnd >= bitstream.size) {
+					jpgContents->scans.pop_back();
+					jpgContents->truncated = true;
+					break;
 				}
+				scan.length = scanEnd - scan.offset;
+				reader.seek(dataStart + scanEnd);
+			}
+			else if (markerID == EOI) {
+				break;
+			}
+			else if (markerID == 0xFF) {
+				markerID = reader.get();
+				continue;
 			}
 			else {
-				jpgContents->huffmanBitstream.push_back(markerFF);
+				// TODO: Add handlers for unused / error markers.
+				ProcessSegment(markerID, reader, *jpgContents);
 			}
-		}
 
-		if (jpgContents->numComponents != 1 && jpgContents->numComponents != 3) {
-			throw std::length_error("Error - Invalid JPG (Unsupported NumComponents)");
+			markerFF = reader.get();
+			markerID = reader.get();
 		}
 
-		for (uint i = 0; i < jpgContents->numComponents; i++) {
-			if (jpgContents->qtTables[jpgContents->components[i].quantizationTableID].set == false) {
-				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized qTable)");
+		if (jpgContents->sofType == SOF2) {
+			if (jpgContents->scans.empty()) {
+				throw std::invalid_argument("Error - Invalid JPG File (File ended before the first scan was complete)");
 			}
-			if (jpgContents->huffmanACTables[jpgContents->components[i].huffmanACTableID].set == false) {
-				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized AC Table)");
+		}
+		else {
+			// the huffman coded bitstream is used as it is, byte stuffing and RST markers are handled while decoding
+			const byte* scanStart = data + reader.offset();
+			size_t scanLength = size - std::min(reader.offset(), size);
+
+			// the scan ends at the EOI marker, anything after it is ignored
+			while (scanLength >= 2 && !(scanStart[scanLength - 2] == 0xFF && scanStart[scanLength - 1] == EOI)) {
+				scanLength--;
 			}
-			if (jpgContents->huffmanDCTables[jpgContents->components[i].huffmanDCTableID].set == false) {
-				throw std::invalid_argument("Error - Invalid JPG (component uses an uninitialized DC Table)");
+			if (!reader || scanLength < 2) {
+				throw std::invalid_argument("Error - Invalid JPG File (File ended without reaching EOF marker in HCB)");
+			}
+			jpgContents->huffmanBitstream = { scanStart, scanLength - 2 };
+
+			// remember where every restart interval starts so they can be decoded in parallel
+			if (jpgContents->restartInterval != 0) {
+				const byte* bitstream = jpgContents->huffmanBitstream.data;
+				const byte* end = bitstream + jpgContents->huffmanBitstream.size;
+				jpgContents->restartOffsets.push_back(0);
+				for (const byte* p = bitstream; (p = static_cast<const byte*>(std::memchr(p, 0xFF, end - p))) != nullptr; p++) {
+					if (p + 1 < end && p[1] >= RST0 && p[1] <= RST7) {
+						jpgContents->restartOffsets.push_back(p + 2 - bitstream);
+					}
+				}
 			}
 		}
 
-		return std::move(jpgContents);
+		CheckComponents(*jpgContents);
 	}
 	void JPGDecoder::WriteBMPFromJPG(const JPGFile& contents, const MCU mcus[], const std::string& fileName) {
-		auto writeInt = [](std::ofstream& out, int theint) {
-			out.put((theint >> 0) & 0xFF);
-			out.put((theint >> 8) & 0xFF);
-			out.put((theint >> 16) & 0xFF);
-			out.put((theint >> 24) & 0xFF);
-		};
-		auto writeShort = [](std::ofstream& out, uint16_t theShort) {
-			out.put((theShort >> 0) & 0xFF);
-			out.put((theShort >> 8) & 0xFF);
-		};
-		std::ofstream out(fileName, std::ios::out | std::ios::binary);
-		const uint padding = (contents.width % 4) * contents.height;
-		out.put('B');
-		out.put('M');
-		writeInt(out, 14 + 12 + ((contents.width * contents.height) * contents.numComponents) + padding);
-		writeInt(out, 0);
-		writeInt(out, 0x1A);
-		writeInt(out, 12);
-		writeShort(out, contents.width);
-		writeShort(out, contents.height);
-		writeShort(out, 1);
-		writeShort(out, 24);
-
-		for (int y = contents.height - 1; y >= 0; y--) {
-			for (uint x = 0; x < contents.width; x++) {
-				const MCU& mcu = mcus[(y / 8) * contents.mcuWidth + (x / 8)];
-				uint mcuX = x % 8;
-				uint mcuY = y % 8;
-				out.put(std::min(std::max(mcu.cr[mcuY * 8 + mcuX], 0), 255));
-				out.put(std::min(std::max(mcu.cb[mcuY * 8 + mcuX], 0), 255));
-				out.put(std::min(std::max(mcu.y[mcuY * 8 + mcuX], 0), 255));
-			}
-			for (uint i = 0; i < padding; i++) {
-				out.put(0);
+		ImageWriter writer(fileName, ImageFormat::BMP, contents.outputWidth, contents.outputHeight, PixelFormat::BGR8);
+		std::vector<byte> row(contents.outputWidth * 3);
+		for (uint y = 0; y < contents.outputHeight; y++) {
+			const MCU* blocks = mcus + (y / 8) * contents.outputBlockWidth;
+			const uint offset = (y % 8) * 8;
+			for (uint x = 0; x < contents.outputWidth; x++) {
+				const MCU& mcu = blocks[x / 8];
+				row[x * 3 + 0] = std::min(std::max(mcu.cr[offset + x % 8], 0), 255);
+				row[x * 3 + 1] = std::min(std::max(mcu.cb[offset + x % 8], 0), 255);
+				row[x * 3 + 2] = std::min(std::max(mcu.y[offset + x % 8], 0), 255);
 			}
+			writer.WriteRow(y, row.data());
 		}
+		writer.Close();
 	}
 	// APP(N) Marker
-	void JPGDecoder::ProcessAPPN(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading APPN marker\n";
-		uint length = (file.get() << 8) + file.get();
+	void JPGDecoder::ProcessAPPN(ByteReader& reader, JPGFile& jpgContents) {
+		uint length = reader.getShort();
 	
-		for (uint i = 0; i < length - 2; i++) {
-			file.get();
-		}
+		reader.skip(length - 2);
 	}
 	// Quantization Tables
-	void JPGDecoder::ProcessQuantizationTable(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading DQT marker\n";
-		int length = (file.get() << 8) + file.get();
+	void JPGDecoder::ProcessQuantizationTable(ByteReader& reader, JPGFile& jpgContents) {
+		int length = reader.getShort();
 		length -= 2;
 
 		while(length > 0) {
-			byte tableInfo = file.get();
+			byte tableInfo = reader.get();
 			length--;
 			byte tableID = tableInfo & 0x0F;
 
@@ -192,13 +352,13 @@ namespace JPG {
 
 			if ((tableInfo >> 4) != 0) {
 				for (uint i = 0; i < 64; i++) {
-					jpgContents.qtTables[tableID].table[MCUMap[i]] = (file.get() << 8) + file.get();
+					jpgContents.qtTables[tableID].table[MCUMap[i]] = reader.getShort();
 				}
 				length -= 128;
 			}
 			else {
 				for (uint i = 0; i < 64; i++) {
-					jpgContents.qtTables[tableID].table[MCUMap[i]] = file.get();
+					jpgContents.qtTables[tableID].table[MCUMap[i]] = reader.get();
 				}
 				length -= 64;
 			}
@@ -209,26 +369,30 @@ namespace JPG {
 		}
 	}
 	// Start of scan (for hcb)
-	void JPGDecoder::ProccesStartOfScan(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading SOS Marker\n";
+	void JPGDecoder::ProccesStartOfScan(ByteReader& reader, JPGFile& jpgContents) {
 		if (jpgContents.numComponents == 0) {
 			throw std::invalid_argument("Error - Invalid SOS Marker (read SOF before SOS which is not allowed)");
 		}
 
-		uint length = (file.get() << 8) + file.get();
+		uint length = reader.getShort();
 		
 		for (uint i = 0; i < jpgContents.numComponents; i++) {
 			jpgContents.components[i].used = false;
 		}
 
-		byte numComponents = file.get();
+		byte numComponents = reader.get();
+		if (numComponents == 0 || numComponents > jpgContents.numComponents) {
+			throw std::length_error("Error - Invalid SOS Marker (number of components is invalid)");
+		}
+		Scan scan;
+		scan.numComponents = numComponents;
 		
 		for (uint i = 0; i < numComponents; i++) {
-			byte componentID = file.get();
+			byte componentID = reader.get();
 			if (jpgContents.zerobased) {
 				componentID++;
 			}
-			if (componentID > numComponents) {
+			if (componentID == 0 || componentID > jpgContents.numComponents) {
 				throw std::length_error("Error - Invalid SOS Marker (component ID is invalid)");
 			}
 
@@ -238,8 +402,9 @@ namespace JPG {
 				throw std::invalid_argument("Error - Invalid SOS Marker (reading same component ID twice)");
 			}
 			component.used = true;
+			scan.components[i] = componentID - 1;
 
-			byte huffmanTableIDs = file.get();
+			byte huffmanTableIDs = reader.get();
 			component.huffmanDCTableID = huffmanTableIDs >> 4;
 			component.huffmanACTableID = huffmanTableIDs & 0x0F;
 			if (component.huffmanACTableID > 3 || component.huffmanDCTableID > 3) {
@@ -247,39 +412,67 @@ namespace JPG {
 			}
 		}
 
-		jpgContents.startOfSelection = file.get();
-		jpgContents.endOfSelection = file.get();
-		byte successiveApproximation = file.get();
+		jpgContents.startOfSelection = reader.get();
+		jpgContents.endOfSelection = reader.get();
+		byte successiveApproximation = reader.get();
 		jpgContents.successiveApproximationHigh = successiveApproximation >> 4;
 		jpgContents.successiveApproximationLow = successiveApproximation & 0x0F;
 
-		if (jpgContents.startOfSelection != 0 || jpgContents.endOfSelection != 63) {
-			throw std::length_error("Error - Invalid SOS Marker (start of selection is invalid)");
+		if (length - 6 - (2 * numComponents) != 0) {
+			throw std::length_error("Error - Invalid SOS (length is not equal to 0 after reading marker)");
+		}
+
+		if (jpgContents.sofType != SOF2) {
+			if (jpgContents.startOfSelection != 0 || jpgContents.endOfSelection != 63) {
+				throw std::length_error("Error - Invalid SOS Marker (start of selection is invalid)");
+			}
+			if (jpgContents.successiveApproximationHigh != 0 || jpgContents.successiveApproximationLow != 0) {
+				throw std::length_error("Error - Invalid SOS Marker (successive approximation is invalid)");
+			}
+			return;
+		}
+
+		// progressive scans hold either the DC coefficients of any components or a band of AC coefficients of one
+		scan.startOfSelection = jpgContents.startOfSelection;
+		scan.endOfSelection = jpgContents.endOfSelection;
+		scan.successiveApproximationHigh = jpgContents.successiveApproximationHigh;
+		scan.successiveApproximationLow = jpgContents.successiveApproximationLow;
+		scan.restartInterval = jpgContents.restartInterval;
+
+		const bool dcScan = scan.startOfSelection == 0;
+		if (dcScan ? scan.endOfSelection != 0 : (scan.endOfSelection < scan.startOfSelection || scan.endOfSelection > 63 || numComponents != 1)) {
+			throw std::length_error("Error - Invalid SOS Marker (spectral selection is invalid)");
 		}
-		if (jpgContents.successiveApproximationHigh != 0 || jpgContents.successiveApproximationLow != 0) {
+		if (scan.successiveApproximationLow > 13 || (scan.successiveApproximationHigh != 0 && scan.successiveApproximationLow != scan.successiveApproximationHigh - 1)) {
 			throw std::length_error("Error - Invalid SOS Marker (successive approximation is invalid)");
 		}
 
-		if (length - 6 - (2 * numComponents) != 0) {
-			throw std::length_error("Error - Invalid SOS (length is not equal to 0 after reading marker)");
+		// tables can be redefined between scans, so every scan keeps a copy of the ones it uses
+		for (uint i = 0; i < numComponents; i++) {
+			const ColorComponent& component = jpgContents.components[scan.components[i]];
+			if (dcScan && scan.successiveApproximationHigh != 0) {
+				continue; // DC refinement bits are not huffman coded
+			}
+			const HuffmanTable& table = dcScan ? jpgContents.huffmanDCTables[component.huffmanDCTableID] : jpgContents.huffmanACTables[component.huffmanACTableID];
+			if (table.set == false) {
+				throw std::invalid_argument("Error - Invalid JPG (scan uses an uninitialized huffman table)");
+			}
+			scan.huffmanTables[i] = table;
 		}
+		jpgContents.scans.push_back(scan);
 	}
-	void JPGDecoder::ProcessComment(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading COM Marker\n";
-		uint length = (file.get() << 8) + file.get();
+	void JPGDecoder::ProcessComment(ByteReader& reader, JPGFile& jpgContents) {
+		uint length = reader.getShort();
 		
-		for (uint i = 0; i < length - 2; i++) {
-			file.get();
-		}
+		reader.skip(length - 2);
 	}
 	// Huffman Tables
-	void JPGDecoder::ProcessHuffmanTable(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading DHT Marker\n";
-		int length = (file.get() << 8) + file.get();
+	void JPGDecoder::ProcessHuffmanTable(ByteReader& reader, JPGFile& jpgContents) {
+		int length = reader.getShort();
 		length -= 2;
 
 		while (length > 0) {
-			byte tableInfo = file.get();
+			byte tableInfo = reader.get();
 			byte tableID = tableInfo & 0x0F;
 			bool ACTable = tableInfo >> 4;
 
@@ -293,7 +486,7 @@ namespace JPG {
 			uint numSymbols = 0;
 			byte numCodesOfLength[16];
 			for (uint i = 0; i < 16; i++) {
-				byte numCodesOfLengthI = file.get();
+				byte numCodesOfLengthI = reader.get();
 				numSymbols += numCodesOfLengthI;
 				numCodesOfLength[i] = numCodesOfLengthI;
 			}
@@ -301,12 +494,14 @@ namespace JPG {
 				throw std::length_error("Error - Invalid DHT Marker (too many symbols)");
 			}
 
+			hTable.offsets[0] = 0;
 			for (uint i = 0; i < 16; i++) {
-				hTable.symbols[i].resize(numCodesOfLength[i]);
-				for (uint j = 0; j < numCodesOfLength[i]; j++) {
-					hTable.symbols[i][j] = file.get();
-				}
+				hTable.offsets[i + 1] = hTable.offsets[i] + numCodesOfLength[i];
+			}
+			for (uint i = 0; i < numSymbols; i++) {
+				hTable.symbols[i] = reader.get();
 			}
+			GenerateHuffmanCodes(hTable);
 
 			length -= 17 + numSymbols;
 		}
@@ -314,207 +509,1487 @@ namespace JPG {
 			throw std::length_error("Error - Invalid DHT Marker (length is not 0)");
 		}
 	}
-	// SOF Marker
-	void JPGDecoder::ProcessStartOfFrame(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading SOF (Start of Frame)\n";
-
-		if (jpgContents.numComponents != 0) {
-			throw std::invalid_argument("Error - Invalid SOF Marker (there are more than one SOF marker which is not allowed)");
-		}
-
-		uint length = (file.get() << 8) + file.get();
-
-		byte precision = file.get();
-		if (precision != 8) {
+	// Throws if ReadJPG can not decode a frame with these components: their IDs, sampling factors, quantization
+	// tables and how many blocks they add up to per MCU. Sets componentIndices to where each component goes in
+	// JPGFile::components. ProcessStartOfFrame and ProbeJPG both check the SOF marker with it.
+	static void CheckFrame(const JPGInfo& frame, byte componentIndices[4]) {
+		if (frame.precision != 8) {
 			throw std::length_error("Error - Invalid SOF Marker (precision is invalid)");
 		}
-
-		jpgContents.height = (file.get() << 8) + file.get();
-		jpgContents.mcuHeight = (jpgContents.height + 7) / 8;
-		jpgContents.width = (file.get() << 8) + file.get();
-		jpgContents.mcuWidth = (jpgContents.width + 7) / 8;
-
-		if (jpgContents.height == 0 || jpgContents.width == 0) {
+		if (frame.height == 0 || frame.width == 0) {
 			throw std::length_error("Error - Invalid JPG (width or height are 0)");
 		}
-
-		jpgContents.numComponents = file.get();
-		if (jpgContents.numComponents == 4) {
+		if (frame.numComponents == 4) {
 			throw std::invalid_argument("Error - Unsupported JPG (CMYK colors are not supported)");
 		}
-		if (jpgContents.numComponents == 0) {
+		if (frame.numComponents == 0) {
 			throw std::length_error("Error - Invalid SOF Marker (numComponents is 0)");
 		}
+		if (frame.numComponents > 4) {
+			throw std::invalid_argument("Error - Invalid SOF Marker (more than 4 components)");
+		}
 
-		for (uint i = 0; i < jpgContents.numComponents; i++) {
-			byte componentID = file.get();
-
+		bool zerobased = false;
+		bool used[3] = { false };
+		byte maxHSF = 1;
+		byte maxVSF = 1;
+		uint blocksPerMCU = 0;
+		for (uint i = 0; i < frame.numComponents; i++) {
+			const JPGInfo::Component& component = frame.components[i];
+			uint componentID = component.id;
 			if (componentID == 0) {
-				jpgContents.zerobased = true;
+				zerobased = true;
 			}
-			if (jpgContents.zerobased) {
+			if (zerobased) {
 				componentID++;
 			}
 
-			if(componentID == 4 || componentID == 5) {
+			if (componentID == 4 || componentID == 5) {
 				throw std::invalid_argument("Error - Unsupported JPG (YIQ colors are not supported)");
 			}
 			if (componentID == 0 || componentID > 3) {
 				throw std::invalid_argument("Error - Invalid JPG (componentID is invalid)");
 			}
-			ColorComponent& component = jpgContents.components[componentID - 1];
-			if (component.used == true) {
+			if (used[componentID - 1]) {
 				throw std::invalid_argument("Error - Invalid SOF Marker (componentID showed up more than once)");
 			}
-			component.used = true;
-			byte samplingFactor = file.get();
-			component.HSF = samplingFactor >> 4;
-			component.VSF = samplingFactor & 0x0F;
-			if (component.HSF != 1 || component.VSF != 1)
-			{
-				throw std::invalid_argument("Error - Unsupported JPG (This decoder does not support subsampled JPEGs)");
+			used[componentID - 1] = true;
+			componentIndices[i] = byte(componentID - 1);
+
+			if (component.HSF == 0 || component.HSF > 4 || component.VSF == 0 || component.VSF > 4) {
+				throw std::invalid_argument("Error - Invalid SOF Marker (sampling factors have to be 1 - 4)");
 			}
-			
-			component.quantizationTableID = file.get();
 			if (component.quantizationTableID > 3) {
 				throw std::length_error("Error - Error - Invalid SOF Marker (QTID is greater than 3 for some reason)");
 			}
+			// a single component is not interleaved, its MCUs are one block whatever its sampling factors are
+			if (frame.numComponents != 1) {
+				maxHSF = std::max(maxHSF, component.HSF);
+				maxVSF = std::max(maxVSF, component.VSF);
+				blocksPerMCU += component.HSF * component.VSF;
+			}
+		}
+		if (blocksPerMCU > 10) {
+			throw std::invalid_argument("Error - Invalid SOF Marker (more than 10 blocks per MCU)");
+		}
+		for (uint i = 0; i < frame.numComponents && frame.numComponents != 1; i++) {
+			if (maxHSF % frame.components[i].HSF != 0 || maxVSF % frame.components[i].VSF != 0) {
+				throw std::invalid_argument("Error - Unsupported JPG (sampling factors that are not a divisor of the largest one)");
+			}
+		}
+	}
+
+	// SOF Marker
+	void JPGDecoder::ProcessStartOfFrame(ByteReader& reader, JPGFile& jpgContents) {
+
+		if (jpgContents.numComponents != 0) {
+			throw std::invalid_argument("Error - Invalid SOF Marker (there are more than one SOF marker which is not allowed)");
 		}
-		if (length - 8 - (3 * jpgContents.numComponents) != 0) {
+
+		uint length = reader.getShort();
+
+		JPGInfo frame;
+		frame.precision = reader.get();
+		frame.height = reader.getShort();
+		frame.width = reader.getShort();
+		frame.numComponents = reader.get();
+		for (uint i = 0; i < frame.numComponents && i < 4; i++) {
+			JPGInfo::Component& component = frame.components[i];
+			component.id = reader.get();
+			const byte samplingFactor = reader.get();
+			component.HSF = samplingFactor >> 4;
+			component.VSF = samplingFactor & 0x0F;
+			component.quantizationTableID = reader.get();
+		}
+		byte componentIndices[4];
+		CheckFrame(frame, componentIndices);
+		if (length - 8 - (3 * frame.numComponents) != 0) {
 			throw std::invalid_argument("Error - Invalid SOF Marker (length is not equal to 0)");
 		}
+
+		jpgContents.height = frame.height;
+		jpgContents.width = frame.width;
+		jpgContents.numComponents = frame.numComponents;
+		for (uint i = 0; i < frame.numComponents; i++) {
+			if (frame.components[i].id == 0) {
+				jpgContents.zerobased = true;
+			}
+			ColorComponent& component = jpgContents.components[componentIndices[i]];
+			component.used = true;
+			// a single component is not interleaved, its MCUs are one block whatever its sampling factors are
+			component.HSF = frame.numComponents == 1 ? 1 : frame.components[i].HSF;
+			component.VSF = frame.numComponents == 1 ? 1 : frame.components[i].VSF;
+			component.quantizationTableID = frame.components[i].quantizationTableID;
+		}
+
+		for (uint i = 0; i < jpgContents.numComponents; i++) {
+			jpgContents.maxHSF = std::max(jpgContents.maxHSF, jpgContents.components[i].HSF);
+			jpgContents.maxVSF = std::max(jpgContents.maxVSF, jpgContents.components[i].VSF);
+		}
+
+		jpgContents.mcuWidth = (jpgContents.width + 8 * jpgContents.maxHSF - 1) / (8 * jpgContents.maxHSF);
+		jpgContents.mcuHeight = (jpgContents.height + 8 * jpgContents.maxVSF - 1) / (8 * jpgContents.maxVSF);
+		jpgContents.blockWidth = jpgContents.mcuWidth * jpgContents.maxHSF;
+		jpgContents.blockHeight = jpgContents.mcuHeight * jpgContents.maxVSF;
+		jpgContents.outputWidth = jpgContents.width;
+		jpgContents.outputHeight = jpgContents.height;
+		jpgContents.outputBlockWidth = jpgContents.blockWidth;
+		jpgContents.outputBlockHeight = jpgContents.blockHeight;
+
+		for (uint i = 0; i < jpgContents.numComponents; i++) {
+			ColorComponent& component = jpgContents.components[i];
+			component.width = (jpgContents.width * component.HSF + jpgContents.maxHSF - 1) / jpgContents.maxHSF;
+			component.height = (jpgContents.height * component.VSF + jpgContents.maxVSF - 1) / jpgContents.maxVSF;
+			component.blockWidth = jpgContents.mcuWidth * component.HSF;
+			component.blockHeight = jpgContents.mcuHeight * component.VSF;
+		}
 	}
 	// DRI Marker
-	void JPGDecoder::ProcessRestartInterval(std::ifstream& file, JPGFile& jpgContents) {
-		std::cout << "Reading DRI Marker\n";
-		uint length = (file.get() << 8) + file.get();
-		jpgContents.restartInterval = (file.get() << 8) + file.get();
+	void JPGDecoder::ProcessRestartInterval(ByteReader& reader, JPGFile& jpgContents) {
+		uint length = reader.getShort();
+		jpgContents.restartInterval = reader.getShort();
 		
 		if (length - 4 != 0) {
 			throw std::length_error("Error - Error - Invalid DRI Marker (length is invalid)");
 		}
 	}
 
-
-
-	// --- Decode JPG Functions --- \\
-
-	
-	class BitReader {
-		const std::vector<byte>& bytes;
-		uint nextByte = 0;
-		uint nextBit = 0;
+	// ByteReader for ProbeJPG that reads a file through a small buffer, skipping a segment seeks over it
+	class FileByteReader {
+		std::ifstream file;
+		byte buffer[4096];
+		size_t position = 0;
+		size_t count = 0;
+		bool overrun = false;
 	public:
-		BitReader(const std::vector<byte>& bytes) :
-			bytes(bytes)
+		explicit FileByteReader(const std::string& filename) :
+			file(filename, std::ios::in | std::ios::binary)
 		{}
 
-		int readBit() {
-			if (nextByte >= bytes.size()) {
-				return -1;
-			}
-			int bit = (bytes[nextByte] >> (7 - nextBit)) & 1;
-			nextBit++;
-			if (nextBit == 8) {
-				nextBit = 0;
-				nextByte += 1;
-			}
-			return bit;
+		bool isOpen() const {
+			return file.is_open();
 		}
 
-		int readBits(const uint length) {
-			int bits = 0;
-			for (uint i = 0; i < length; i++) {
-				int bit = readBit();
-				if (bit == -1) {
-					bits = -1;
-					break;
+		byte get() {
+			if (position == count) {
+				file.read(reinterpret_cast<char*>(buffer), sizeof(buffer));
+				position = 0;
+				count = size_t(file.gcount());
+				if (count == 0) {
+					overrun = true;
+					return 0xFF;
 				}
-				bits = (bits << 1) | bit;
 			}
-			return bits;
+			return buffer[position++];
+		}
+
+		uint getShort() {
+			const uint high = get();
+			return (high << 8) + get();
+		}
+
+		void skip(const size_t length) {
+			if (length <= count - position) {
+				position += length;
+				return;
+			}
+			file.clear();
+			file.seekg(std::streamoff(length - (count - position)), std::ios::cur);
+			position = count = 0;
+		}
+
+		explicit operator bool() const {
+			return !overrun;
 		}
 	};
 
+	// walks the marker segments up to the first SOS marker, reading only the SOF and DRI segments
+	template<typename Reader>
+	JPGInfo ProbeMarkers(Reader& reader) {
+		if (reader.get() != 0xFF || reader.get() != SOI) {
+			throw std::invalid_argument("Error - Invalid JPG file (markerFF is not FF or markerID is not SOI at the beginnning)");
+		}
 
-	std::unique_ptr<MCU[]> JPGDecoder::DecodeJPG(JPGFile& contents) {
-		auto mcus = std::make_unique<MCU[]>(contents.mcuWidth * contents.mcuHeight);
-		DecodeHuffmanData(mcus.get(), contents);
-		DequantizeMCUs(mcus.get(), contents);
-		InverseDiscreteCosineTransform(mcus.get(), contents);
-		YCbCrToRGB(mcus.get(), contents);
-		return std::move(mcus);
-	}
+		JPGInfo info;
+		while (true) {
+			if (reader.get() != 0xFF) {
+				throw std::invalid_argument("Error - Invalid JPG file (markerFF is not 0xFF)");
+			}
+			byte markerID = reader.get();
+			while (markerID == 0xFF) {
+				markerID = reader.get();
+			}
+			if (!reader) {
+				throw std::invalid_argument("Error - Invalid JPG File (File ended before the first scan)");
+			}
+			if (markerID == SOS || markerID == EOI) {
+				break;
+			}
+			if ((markerID >= RST0 && markerID <= RST7) || markerID == TEM) {
+				continue;
+			}
 
-	std::string convert(int num, int size) {
-		std::string theThing;
-		for (int i = 31; i >= 0; i--) {
-			int k = num >> i;
-			if (k & 1) {
-				if(i < size)
-					theThing.push_back('1');
+			const uint length = reader.getShort();
+			if (length < 2) {
+				throw std::length_error("Error - Invalid JPG (marker segment length is invalid)");
+			}
+			const bool sof = markerID >= SOF0 && markerID <= SOF15 && markerID != DHT && markerID != JPG && markerID != DAC;
+			if (sof && info.sofType == 0) {
+				info.sofType = markerID;
+				info.precision = reader.get();
+				info.height = reader.getShort();
+				info.width = reader.getShort();
+				info.numComponents = reader.get();
+				if (info.numComponents == 0 || info.numComponents > 4 || length != 8 + 3u * info.numComponents) {
+					throw std::invalid_argument("Error - Invalid SOF Marker (numComponents or length is invalid)");
+				}
+				for (uint i = 0; i < info.numComponents; i++) {
+					JPGInfo::Component& component = info.components[i];
+					component.id = reader.get();
+					const byte samplingFactor = reader.get();
+					component.HSF = samplingFactor >> 4;
+					component.VSF = samplingFactor & 0x0F;
+					component.quantizationTableID = reader.get();
+				}
+			}
+			else if (markerID == DRI && length == 4) {
+				info.restartInterval = reader.getShort();
 			}
 			else {
-				if (i < size)
-					theThing.push_back('0');
+				reader.skip(length - 2);
 			}
 		}
-		theThing.push_back('\n');
-		return theThing;
-	}
 
-	void JPGDecoder::GenerateHuffmanCodes(HuffmanTable& hTable) {
-		uint code = 0;
-		for (uint i = 0; i < 16; i++) {
-			for (uint j = 0; j < hTable.symbols[i].size(); j++) {
-				hTable.codes[i].push_back(code);
-				OutputDebugStringA(convert(code, i + 1).c_str());
-				code += 1;
+		if (info.sofType == 0) {
+			throw std::invalid_argument("Error - Invalid JPG File (no SOF marker in front of the first scan)");
+		}
+		info.supported = (info.sofType == SOF0 || info.sofType == SOF2) && (info.numComponents == 1 || info.numComponents == 3);
+		if (info.supported) {
+			// the same checks that ProcessStartOfFrame does
+			try {
+				byte componentIndices[4];
+				CheckFrame(info, componentIndices);
 			}
-			code <<= 1;
+			catch (const std::exception&) {
+				info.supported = false;
+			}
+		}
+		return info;
+	}
+
+	JPGInfo JPGDecoder::ProbeJPG(const std::string& filename) {
+		FileByteReader reader(filename);
+		if (!reader.isOpen()) {
+			throw std::invalid_argument("Error - Cannot open file! (Is the filename correct?)");
+		}
+		return ProbeMarkers(reader);
+	}
+
+	JPGInfo JPGDecoder::ProbeJPG(const byte* data, const size_t size) {
+		ByteReader reader(data, size);
+		return ProbeMarkers(reader);
+	}
+
+
+
+	// --- Decode JPG Functions --- \\
+
+	
+#if JPG_STATS
+	// statistics of the part of a decode this thread is working on, null if nobody collects them
+	thread_local DecodeStats* threadStats = nullptr;
+#define JPG_COUNT(statement) if (threadStats != nullptr) { threadStats->statement; }
+#else
+#define JPG_COUNT(statement)
+#endif
+
+	void AddStats(DecodeStats& total, const DecodeStats& stats) {
+		total.times.huffman += stats.times.huffman;
+		total.times.idct += stats.times.idct;
+		total.times.color += stats.times.color;
+		total.entropyBytes += stats.entropyBytes;
+		total.entropyBits += stats.entropyBits;
+		total.symbols += stats.symbols;
+		total.restarts += stats.restarts;
+		total.blocks += stats.blocks;
+		for (uint i = 0; i < 64; i++) {
+			total.blocksByLastCoefficient[i] += stats.blocksByLastCoefficient[i];
+		}
+		for (uint i = 0; i < 17; i++) {
+			total.zeroRuns[i] += stats.zeroRuns[i];
 		}
 	}
 
-	void JPGDecoder::DecodeHuffmanData(MCU mcus[], JPGFile& contents) {
-		// Generate codes for all the used huffman tables
-		for (uint i = 0; i < 4; ++i) {
-			if (contents.huffmanACTables[i].set) {
-				GenerateHuffmanCodes(contents.huffmanACTables[i]);
+	// statistics the parts of a decode that this thread hands to other threads have to go to
+	DecodeStats* CurrentStats() {
+#if JPG_STATS
+		return threadStats;
+#else
+		return nullptr;
+#endif
+	}
+
+	// The counters of this thread go into its own DecodeStats while it works on a part of a decode, they are added
+	// to target (which the other threads of the decode share) at the end.
+	class StatsScope {
+#if JPG_STATS
+		DecodeStats* target;
+		DecodeStats* previous;
+		DecodeStats local;
+	public:
+		explicit StatsScope(DecodeStats* target) :
+			target(target),
+			previous(threadStats)
+		{
+			if (target != nullptr) {
+				threadStats = &local;
 			}
-			if (contents.huffmanDCTables[i].set) {
-				GenerateHuffmanCodes(contents.huffmanDCTables[i]);
+		}
+		~StatsScope() {
+			if (target == nullptr) {
+				return;
 			}
+			threadStats = previous;
+			static std::mutex mutex;
+			std::lock_guard<std::mutex> lock(mutex);
+			AddStats(*target, local);
 		}
+#else
+	public:
+		explicit StatsScope(DecodeStats*) {}
+#endif
+		StatsScope(const StatsScope&) = delete;
+		StatsScope& operator=(const StatsScope&) = delete;
+	};
 
-		BitReader b(contents.huffmanBitstream);
-		int prevCoeff[3] = { 0 };
+	// adds the time between laps to a stage of times, and of the statistics of this thread if they are collected
+	class StageTimer {
+		StageTimes* times;
+		bool active;
+		std::chrono::steady_clock::time_point start;
+	public:
+		explicit StageTimer(StageTimes* times = nullptr) :
+			times(times),
+			active(times != nullptr || CurrentStats() != nullptr)
+		{
+			if (active) {
+				start = std::chrono::steady_clock::now();
+			}
+		}
 
-		for (uint i = 0; i < contents.mcuWidth * contents.mcuHeight; i++) {
-			for (uint j = 0; j < contents.numComponents; j++) {
-				DecodeMCUComponent(b, 
-					contents.huffmanDCTables[contents.components[j].huffmanDCTableID], 
-					contents.huffmanACTables[contents.components[j].huffmanACTableID], 
-					mcus[i][j], prevCoeff[j]);
+		void lap(double StageTimes::* stage) {
+			if (!active) {
+				return;
+			}
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			const double seconds = std::chrono::duration<double>(now - start).count();
+			if (times != nullptr) {
+				times->*stage += seconds;
 			}
+			JPG_COUNT(times.*stage += seconds)
+			start = now;
 		}
-	}
-	byte GetNextSymbol(BitReader& b, const HuffmanTable& huffmanTable) {
-		int code = 0;
-		for (uint i = 0; i < 16; i++) {
-			int bit = b.readBit();
-			if (bit == -1) {
-				return -1;
+	};
+
+	// Reads bits straight from the byte stuffed entropy coded data. Bytes are loaded into a 64 bit
+	// accumulator several at a time, 0xFF00 is unstuffed while refilling and reading stops at the
+	// first marker. Past a marker (or the end of the data) the accumulator is filled with zeros.
+	class BitReader {
+		const byte* position;
+		const byte* end;
+		uint64_t buffer = 0; // unread bits, left aligned
+		uint bitsLeft = 0;
+		uint paddingBits = 0; // zero bits at the end of the buffer that are not part of the data
+		byte marker = 0; // marker that stopped the refill (0 if no marker has been reached)
+
+		void refill() {
+			// fast path: none of the next 8 bytes is 0xFF so they can be loaded without unstuffing. It needs room for at
+			// least one byte, restart() refills whatever is left in the buffer.
+			if (marker == 0 && bitsLeft <= 56 && end - position >= 8) {
+				uint64_t bytes = 0;
+				for (uint i = 0; i < 8; i++) {
+					bytes = (bytes << 8) | position[i];
+				}
+				const uint64_t inverted = ~bytes;
+				if (((inverted - 0x0101010101010101ull) & ~inverted & 0x8080808080808080ull) == 0) {
+					const uint numBytes = (64 - bitsLeft) >> 3;
+					buffer |= (bytes >> (64 - numBytes * 8)) << (64 - bitsLeft - numBytes * 8);
+					bitsLeft += numBytes * 8;
+					position += numBytes;
+					JPG_COUNT(entropyBytes += numBytes)
+					return;
+				}
 			}
-			code = (code << 1) | bit;
-			for (uint j = 0; j < huffmanTable.codes[i].size(); j++) {
-				if (code == huffmanTable.codes[i][j]) {
-					return huffmanTable.symbols[i][j];
+
+#if JPG_STATS
+			const byte* const start = position;
+#endif
+			while (bitsLeft <= 56) {
+				byte nextByte = 0;
+				if (marker != 0 || position >= end) {
+					paddingBits += 8;
+				}
+				else if (*position != 0xFF) {
+					nextByte = *position++;
+				}
+				else {
+					// skip fill bytes, 0xFF00 is a stuffed 0xFF and anything else is a marker
+					const byte* next = position + 1;
+					while (next < end && *next == 0xFF) {
+						next++;
+					}
+					if (next < end && *next == 0x00) {
+						nextByte = 0xFF;
+						position = next + 1;
+					}
+					else {
+						marker = next < end ? *next : EOI;
+						position = next - 1;
+						paddingBits += 8;
+					}
 				}
+				buffer |= uint64_t(nextByte) << (56 - bitsLeft);
+				bitsLeft += 8;
 			}
+			JPG_COUNT(entropyBytes += position - start)
+		}
+	public:
+		BitReader(const byte* data, const size_t size) :
+			position(data),
+			end(data + size)
+		{}
+
+		// returns the next length (1 - 32) bits without consuming them
+		uint peek(const uint length) {
+			if (bitsLeft < length) {
+				refill();
+			}
+			return uint(buffer >> (64 - length));
+		}
+
+		void consume(const uint length) {
+			buffer <<= length;
+			bitsLeft -= length;
+			JPG_COUNT(entropyBits += length)
+		}
+
+		int readBits(const uint length) {
+			if (length == 0) {
+				return 0;
+			}
+			const int bits = peek(length);
+			consume(length);
+			return bits;
+		}
+
+		// true if more bits were consumed than there were before the marker / end of data
+		bool overrun() const {
+			return bitsLeft < paddingBits;
+		}
+
+		// true if the reader got to the end of the data without finding a marker
+		bool pastEnd() const {
+			return marker == 0 && position >= end;
+		}
+
+		// true if more data after the end could not have changed what was read so far: the reader stopped at a marker,
+		// did not reach the end, or still has 16 bits of data left (the most GetNextSymbol looks ahead)
+		bool complete() const {
+			return !pastEnd() || bitsLeft >= paddingBits + 16;
+		}
+
+		// bytes from data to the next one the reader would load
+		size_t offset(const byte* data) const {
+			return position - data;
+		}
+
+		// continues with data, which starts with the byte the reader would load next and holds more of the same
+		// bitstream than before. The zeros that were read past the old end are replaced by the new bytes.
+		void resume(const byte* data, const size_t size) {
+			position = data;
+			end = data + size;
+			if (marker == 0) {
+				bitsLeft -= paddingBits;
+				paddingBits = 0;
+			}
+		}
+
+		// skips to the RSTn marker at the end of the current restart interval and resets the reader after it
+		void restart(const byte expectedMarker) {
+			if (marker == 0) {
+				refill();
+				while (marker == 0 && position < end) {
+					bitsLeft = 0;
+					buffer = 0;
+					refill();
+				}
+			}
+			if (marker != expectedMarker) {
+				throw std::invalid_argument("Error - Invalid JPG File (expected a RST marker at the end of the restart interval)");
+			}
+			JPG_COUNT(restarts++)
+			position += 2;
+			buffer = 0;
+			bitsLeft = 0;
+			paddingBits = 0;
+			marker = 0;
+		}
+	};
+
+
+	// samples per block side of component j when decoding at 1 / scale of the size. Like libjpeg, components with
+	// smaller sampling factors get a larger IDCT instead of being upsampled as far as the factors allow it.
+	uint ComponentBlockSize(const JPGFile& contents, const uint j, const uint scale) {
+		const ColorComponent& component = contents.components[j];
+		const uint outputSize = 8 / scale;
+		uint size = outputSize;
+		while (size < 8 && (contents.maxHSF * outputSize) % (component.HSF * size * 2) == 0 && (contents.maxVSF * outputSize) % (component.VSF * size * 2) == 0) {
+			size *= 2;
+		}
+		return size;
+	}
+
+	// where the converted pixel rows go: straight into the caller's buffer, or through a row buffer into the
+	// callback of DecodeJPGRows or the MCU array of DecodeJPG
+	struct OutputRows {
+		PixelFormat format = PixelFormat::RGB8;
+		byte* pixels = nullptr;
+		size_t stride = 0;
+		MCU* mcus = nullptr; // always RGB8
+		const RowCallback* callback = nullptr;
+
+		// buffer to convert row into, rowBuffer unless the caller provided one
+		byte* row(const uint row, byte* rowBuffer) const {
+			return pixels != nullptr ? pixels + row * stride : rowBuffer;
+		}
+
+		// passes on a row that was converted into the row buffer
+		void write(const JPGFile& contents, const uint row, const byte* pixels) const {
+			if (this->pixels != nullptr) {
+				return;
+			}
+			if (callback != nullptr) {
+				(*callback)(row, pixels);
+				return;
+			}
+			MCU* blocks = mcus + (row / 8) * contents.outputBlockWidth;
+			const uint offset = (row % 8) * 8;
+			for (uint x = 0; x < contents.outputWidth; x++) {
+				MCU& mcu = blocks[x / 8];
+				mcu.y[offset + x % 8] = pixels[x * 3];
+				mcu.cb[offset + x % 8] = pixels[x * 3 + 1];
+				mcu.cr[offset + x % 8] = pixels[x * 3 + 2];
+			}
+		}
+	};
+
+	void JPGDecoder::SetOutputSize(JPGFile& contents, const uint scale, const Rect& crop) {
+		if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+			throw std::invalid_argument("Error - Unsupported scale (has to be 1, 2, 4 or 8)");
+		}
+		const uint width = (contents.width + scale - 1) / scale;
+		const uint height = (contents.height + scale - 1) / scale;
+		if (crop.x >= width || crop.y >= height) {
+			throw std::invalid_argument("Error - Crop rectangle is outside of the image");
+		}
+		contents.outputX = crop.x;
+		contents.outputY = crop.y;
+		contents.outputWidth = crop.width == 0 ? width - crop.x : std::min(crop.width, width - crop.x);
+		contents.outputHeight = crop.height == 0 ? height - crop.y : std::min(crop.height, height - crop.y);
+		const bool cropped = contents.outputWidth != width || contents.outputHeight != height;
+		contents.outputBlockWidth = cropped ? (contents.outputWidth + 7) / 8 : (contents.blockWidth * 8 / scale + 7) / 8;
+		contents.outputBlockHeight = cropped ? (contents.outputHeight + 7) / 8 : (contents.blockHeight * 8 / scale + 7) / 8;
+	}
+
+	uint JPGDecoder::BytesPerPixel(const PixelFormat format) {
+		switch (format) {
+		case PixelFormat::RGBA8:
+			return 4;
+		case PixelFormat::Gray8:
+			return 1;
+		default:
+			return 3;
+		}
+	}
+
+	std::unique_ptr<MCU[]> JPGDecoder::DecodeJPG(JPGFile& contents, const DecodeOptions& options) {
+		SetOutputSize(contents, options.scale, options.crop);
+		auto mcus = std::make_unique<MCU[]>(contents.outputBlockWidth * contents.outputBlockHeight);
+		OutputRows output;
+		output.mcus = mcus.get();
+		DecodeMemory memory;
+		Decode(contents, output, options, memory);
+		return mcus;
+	}
+
+	void JPGDecoder::DecodeJPG(JPGFile& contents, byte* pixels, const size_t stride, const DecodeOptions& options) {
+		SetOutputSize(contents, options.scale, options.crop);
+		if (pixels == nullptr || stride < size_t(contents.outputWidth) * BytesPerPixel(options.pixelFormat)) {
+			throw std::invalid_argument("Error - Output buffer is missing or its stride is smaller than a row of pixels");
+		}
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.pixels = pixels;
+		output.stride = stride;
+		DecodeMemory memory;
+		Decode(contents, output, options, memory);
+	}
+
+	void JPGDecoder::DecodeJPGRows(JPGFile& contents, const RowCallback& rowCallback, const DecodeOptions& options) {
+		SetOutputSize(contents, options.scale, options.crop);
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.callback = &rowCallback;
+		DecodeMemory memory;
+		Decode(contents, output, options, memory);
+	}
+
+	void JPGDecoder::DecodeStages(JPGFile& contents, byte* pixels, const size_t stride, const DecodeOptions& options, StageTimes& times) {
+		SetOutputSize(contents, options.scale, options.crop);
+		if (pixels == nullptr || stride < size_t(contents.outputWidth) * BytesPerPixel(options.pixelFormat)) {
+			throw std::invalid_argument("Error - Output buffer is missing or its stride is smaller than a row of pixels");
+		}
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.pixels = pixels;
+		output.stride = stride;
+		DecodeOptions multiPass = options;
+		multiPass.pipeline = Pipeline::MultiPass;
+		contents.scansDecoded = 0;
+		DecodeMemory memory;
+		Decode(contents, output, multiPass, memory, &times);
+	}
+
+	void JPGDecoder::Decode(JPGFile& contents, const OutputRows& output, const DecodeOptions& options, DecodeMemory& memory, StageTimes* times) {
+		StatsScope statsScope(options.stats);
+		StageTimer timer(times);
+		const bool progressive = contents.sofType == SOF2;
+		if (progressive) {
+			DecodeScans(contents, options.numScans);
+		}
+		if (options.pipeline == Pipeline::Fused && options.idctMethod == IDCTMethod::Integer) {
+			timer.lap(&StageTimes::huffman);
+			DecodeFused(output, contents, options, memory);
+			return;
+		}
+
+		const uint scale = options.scale;
+		ComponentPlane* planes = progressive ? contents.planes : memory.planes;
+		if (!progressive) {
+			for (uint j = 0; j < contents.numComponents; j++) {
+				planes[j].coefficients.resize(size_t(contents.components[j].blockWidth) * contents.components[j].blockHeight * 64);
+				planes[j].lastCoefficients.resize(planes[j].coefficients.size() / 64);
+			}
+			DecodeHuffmanData(planes, contents, options.numThreads);
+		}
+		timer.lap(&StageTimes::huffman);
+
+		for (uint j = 0; j < contents.numComponents; j++) {
+			const uint blockSize = ComponentBlockSize(contents, j, scale);
+			planes[j].samples.resize(planes[j].coefficients.size() / 64 * blockSize * blockSize);
+		}
+		if (options.idctMethod == IDCTMethod::Integer) {
+			DequantizeIDCT(planes, contents, scale);
+		}
+		else {
+			InverseDiscreteCosineTransform(planes, contents, options.idctMethod, scale);
+		}
+		timer.lap(&StageTimes::idct);
+
+		if (memory.arenas.empty()) {
+			memory.arenas.resize(1);
+		}
+		memory.arenas[0].Reset();
+		YCbCrToRGB(planes, contents, output, options.upsampling, scale, memory.arenas[0]);
+		timer.lap(&StageTimes::color);
+	}
+
+	void JPGDecoder::GenerateHuffmanCodes(HuffmanTable& hTable) {
+		uint code = 0;
+		std::fill(std::begin(hTable.lookup), std::end(hTable.lookup), 0);
+		for (uint i = 0; i < 16; i++) {
+			const uint numCodes = hTable.offsets[i + 1] - hTable.offsets[i];
+			hTable.valueOffset[i] = int(hTable.offsets[i]) - int(code);
+			hTable.maxCode[i] = numCodes == 0 ? -1 : int(code + numCodes - 1);
+
+			for (uint j = hTable.offsets[i]; j < hTable.offsets[i + 1]; j++) {
+				if (code >= (1u << (i + 1))) {
+					throw std::invalid_argument("Error - Invalid DHT Marker (too many codes of length " + std::to_string(i + 1) + ")");
+				}
+				// every lookup index that starts with this code resolves to it
+				if (i < HuffmanLookupBits) {
+					const uint shift = HuffmanLookupBits - (i + 1);
+					const uint16_t entry = uint16_t(((i + 1) << 8) | hTable.symbols[j]);
+					std::fill(hTable.lookup + (code << shift), hTable.lookup + ((code + 1) << shift), entry);
+				}
+				code += 1;
+			}
+			code <<= 1;
+		}
+	}
+
+	// components that are needed for the pixels, Gray8 only needs Y
+	uint OutputComponents(const JPGFile& contents, const PixelFormat format) {
+		return format == PixelFormat::Gray8 ? 1 : contents.numComponents;
+	}
+
+	// Turns rows of component samples into rows of output pixels. Components with smaller sampling factors are
+	// upsampled one row at a time right before the color conversion, so there are no full resolution chroma planes.
+	// Only the columns and rows of the crop are converted.
+	class RowConverter {
+		enum class Mode {
+			Copy, // full resolution, or only upsampled vertically by repeating rows
+			Box,
+			FancyH2V1,
+			FancyH1V2,
+			FancyH2V2
+		};
+
+		const JPGFile& contents;
+		const Kernels& kernels;
+		uint width; // output pixels per row (of the crop)
+		Mode modes[3] = { Mode::Copy, Mode::Copy, Mode::Copy };
+		uint horizontalFactors[3] = { 1, 1, 1 }; // output pixels per sample
+		uint verticalFactors[3] = { 1, 1, 1 };
+		uint componentWidths[3] = { 0 }; // samples per row and rows of each component without the padding
+		uint componentHeights[3] = { 0 };
+		byte* upsampled[3] = { nullptr }; // one full resolution row per upsampled component
+		byte* rowBuffer = nullptr; // the converted row if it does not go straight into the caller's buffer
+	public:
+		// the rows are allocated from arena
+		RowConverter(const JPGFile& contents, const Upsampling upsampling, const uint scale, Arena& arena) :
+			contents(contents),
+			kernels(GetKernels()),
+			width(contents.outputWidth)
+		{
+			// libjpeg does not filter at 1/8 of the size either
+			const uint outputSize = 8 / scale;
+			const bool fancy = upsampling == Upsampling::Fancy && outputSize > 1;
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const ColorComponent& component = contents.components[j];
+				const uint blockSize = ComponentBlockSize(contents, j, scale);
+				const uint h = contents.maxHSF * outputSize / (component.HSF * blockSize);
+				const uint v = contents.maxVSF * outputSize / (component.VSF * blockSize);
+				horizontalFactors[j] = h;
+				verticalFactors[j] = v;
+				componentWidths[j] = (contents.width * component.HSF * blockSize + contents.maxHSF * 8 - 1) / (contents.maxHSF * 8);
+				componentHeights[j] = (contents.height * component.VSF * blockSize + contents.maxVSF * 8 - 1) / (contents.maxVSF * 8);
+
+				// like libjpeg, only factors of 2 are filtered and rows of up to 2 samples are not
+				if (fancy && h == 2 && v == 1 && componentWidths[j] > 2) {
+					modes[j] = Mode::FancyH2V1;
+				}
+				else if (fancy && h == 1 && v == 2) {
+					modes[j] = Mode::FancyH1V2;
+				}
+				else if (fancy && h == 2 && v == 2 && componentWidths[j] > 2) {
+					modes[j] = Mode::FancyH2V2;
+				}
+				else if (h != 1) {
+					modes[j] = Mode::Box;
+				}
+				if (modes[j] != Mode::Copy) {
+					// the filtered modes upsample a few samples more than the crop needs
+					upsampled[j] = arena.Allocate<byte>(width + 16);
+				}
+			}
+			rowBuffer = arena.Allocate<byte>(contents.outputWidth * 4);
+		}
+
+		// true if some output columns need the sample column left or right of the one they lie in
+		bool usesNeighbourColumns() const {
+			for (uint j = 0; j < contents.numComponents; j++) {
+				if (modes[j] == Mode::FancyH2V1 || modes[j] == Mode::FancyH2V2) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// true if some output rows need the sample row above or below the one they lie in
+		bool usesNeighbourRows() const {
+			for (uint j = 0; j < contents.numComponents; j++) {
+				if (modes[j] == Mode::FancyH1V2 || modes[j] == Mode::FancyH2V2) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		// sample row of component j that outputRow lies in
+		uint nearRow(const uint j, const uint outputRow) const {
+			return outputRow / verticalFactors[j];
+		}
+
+		// sample row that vertical fancy upsampling blends in (the near row for the other modes),
+		// the outermost row of the component is repeated past its edges
+		uint farRow(const uint j, const uint outputRow) const {
+			const uint row = nearRow(j, outputRow);
+			if (modes[j] != Mode::FancyH1V2 && modes[j] != Mode::FancyH2V2) {
+				return row;
+			}
+			if (outputRow % 2 == 0) {
+				return row == 0 ? 0 : row - 1;
+			}
+			return std::min(row + 1, componentHeights[j] - 1);
+		}
+
+		// converts outputRow (of the scaled image) from the nearRow and farRow sample rows of each component, rows
+		// outside of the crop are skipped
+		void convert(const byte* const nearRows[3], const byte* const farRows[3], const uint outputRow, const OutputRows& output) {
+			if (outputRow < contents.outputY || outputRow >= contents.outputY + contents.outputHeight) {
+				return;
+			}
+			const uint firstColumn = contents.outputX;
+			const byte* rows[3] = { nullptr };
+			for (uint j = 0; j < OutputComponents(contents, output.format); j++) {
+				byte* upsampledRow = upsampled[j];
+				rows[j] = upsampledRow;
+
+				// the filters get the samples under the crop and one more on either side, so the replicated edges of
+				// the window only change pixels outside of the crop. They need at least 3 samples.
+				uint firstSample = 0;
+				uint endSample = componentWidths[j];
+				if (modes[j] == Mode::FancyH2V1 || modes[j] == Mode::FancyH2V2) {
+					firstSample = firstColumn / 2 == 0 ? 0 : firstColumn / 2 - 1;
+					endSample = std::min(componentWidths[j], (firstColumn + width - 1) / 2 + 2);
+					while (endSample - firstSample < 3) {
+						if (endSample < componentWidths[j]) {
+							endSample++;
+						}
+						else {
+							firstSample--;
+						}
+					}
+					rows[j] = upsampledRow + (firstColumn - 2 * firstSample);
+				}
+
+				switch (modes[j]) {
+				case Mode::Copy:
+					rows[j] = nearRows[j] + firstColumn;
+					break;
+				case Mode::Box:
+					for (uint x = 0; x < width; x++) {
+						upsampledRow[x] = nearRows[j][(firstColumn + x) / horizontalFactors[j]];
+					}
+					break;
+				case Mode::FancyH2V1:
+					kernels.upsampleH2V1(nearRows[j] + firstSample, upsampledRow, endSample - firstSample);
+					break;
+				case Mode::FancyH1V2:
+					kernels.upsampleH1V2(nearRows[j] + firstColumn, farRows[j] + firstColumn, upsampledRow, width, outputRow % 2 == 1);
+					break;
+				case Mode::FancyH2V2:
+					kernels.upsampleH2V2(nearRows[j] + firstSample, farRows[j] + firstSample, upsampledRow, endSample - firstSample);
+					break;
+				}
+			}
+
+			const uint outputWidth = contents.outputWidth;
+			const PixelFormat format = output.format;
+			byte* pixels = output.row(outputRow - contents.outputY, rowBuffer);
+			if (contents.numComponents == 1 || format == PixelFormat::Gray8) {
+				switch (format) {
+				case PixelFormat::Gray8:
+					std::copy(rows[0], rows[0] + outputWidth, pixels);
+					break;
+				case PixelFormat::RGBA8:
+					kernels.grayToRGBA(rows[0], pixels, outputWidth);
+					break;
+				default:
+					kernels.grayToRGB(rows[0], pixels, outputWidth);
+					break;
+				}
+			}
+			else {
+				switch (format) {
+				case PixelFormat::BGR8:
+					kernels.ycbcrToBGR(rows[0], rows[1], rows[2], pixels, outputWidth);
+					break;
+				case PixelFormat::RGBA8:
+					kernels.ycbcrToRGBA(rows[0], rows[1], rows[2], pixels, outputWidth);
+					break;
+				default:
+					kernels.ycbcrToRGB(rows[0], rows[1], rows[2], pixels, outputWidth);
+					break;
+				}
+			}
+			output.write(contents, outputRow - contents.outputY, pixels);
+		}
+	};
+
+	// first and last sample row of each component in a band, for the output rows next to the edges between bands
+	struct BandEdgeRows {
+		byte* first[3];
+		byte* last[3];
+	};
+
+	// Whole image coefficients that the fused pipeline transforms instead of huffman decoding them itself. The scans of
+	// progressive JPGs have decoded all of them already, JPGs without restart markers are decoded on another thread
+	// that makes them available one MCU row at a time.
+	class CoefficientRows {
+		const ComponentPlane* planes;
+		mutable std::mutex mutex;
+		mutable std::condition_variable rowsDecoded;
+		uint numRows; // MCU rows that are decoded
+		bool failed = false;
+	public:
+		CoefficientRows(const ComponentPlane planes[], const uint numRows) :
+			planes(planes),
+			numRows(numRows)
+		{}
+
+		const ComponentPlane& plane(const uint j) const {
+			return planes[j];
+		}
+
+		// waits until MCU row y is decoded, false if the decoding failed
+		bool wait(const uint y) const {
+			std::unique_lock<std::mutex> lock(mutex);
+			rowsDecoded.wait(lock, [&]() { return numRows > y || failed; });
+			return !failed;
+		}
+
+		void decoded(const uint rows) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				numRows = rows;
+			}
+			rowsDecoded.notify_all();
+		}
+
+		void fail() {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				failed = true;
+			}
+			rowsDecoded.notify_all();
+		}
+	};
+
+	bool JPGDecoder::HasRestartOffsets(const JPGFile& contents) {
+		if (contents.restartInterval == 0) {
+			return false;
+		}
+		const uint numMCUs = contents.mcuWidth * contents.mcuHeight;
+		return contents.restartOffsets.size() == (numMCUs + contents.restartInterval - 1) / contents.restartInterval;
+	}
+
+	// what the MCU loop of a baseline scan needs, looked up once instead of for every block
+	struct MCUScan {
+		uint numComponents = 0;
+		uint mcuWidth = 0;
+		uint restartInterval = 0;
+		const HuffmanTable* dcTables[3] = { nullptr };
+		const HuffmanTable* acTables[3] = { nullptr };
+		uint HSF[3] = { 0 };
+		uint VSF[3] = { 0 };
+		uint blockWidths[3] = { 0 };
+		int16_t* coefficients[3] = { nullptr }; // first block of MCU row 0
+		byte* lastCoefficients[3] = { nullptr }; // zigzag index of the last non-zero coefficient of each of these blocks
+		size_t mcuRowBlocks[3] = { 0 }; // blocks from one MCU row to the next (0 = every row goes to the same place)
+		// DecodeMCUs for the layout of the image
+		void (*decode)(BitReader& b, const MCUScan& scan, const uint firstMCU, const uint endMCU, const uint resumeMCU, int prevCoeff[3]) = nullptr;
+	};
+
+	// Huffman decodes the MCUs firstMCU to endMCU - 1, b started at resumeMCU (the first MCU of a restart interval
+	// has a RST marker in front of it unless b starts there). Gray and 3 component images with 1x1 chroma get their own
+	// instantiation, so the block loops are unrolled and the sampling factors are constants. Layouts that are not
+	// specialized pass 0 and take them from scan.
+	template<uint numComponents, uint lumaHSF, uint lumaVSF, bool restarts>
+	void JPGDecoder::DecodeMCUs(BitReader& b, const MCUScan& scan, const uint firstMCU, const uint endMCU, const uint resumeMCU, int prevCoeff[3]) {
+		const uint components = numComponents != 0 ? numComponents : scan.numComponents;
+		uint x = firstMCU % scan.mcuWidth;
+		uint y = firstMCU / scan.mcuWidth;
+		for (uint i = firstMCU; i < endMCU; i++) {
+			if (restarts && i != resumeMCU && i % scan.restartInterval == 0) {
+				b.restart(RST0 + ((i / scan.restartInterval - 1) & 7));
+				prevCoeff[0] = prevCoeff[1] = prevCoeff[2] = 0;
+			}
+			for (uint j = 0; j < components; j++) {
+				const uint hsf = numComponents == 0 ? scan.HSF[j] : j == 0 ? lumaHSF : 1;
+				const uint vsf = numComponents == 0 ? scan.VSF[j] : j == 0 ? lumaVSF : 1;
+				const size_t firstBlock = y * scan.mcuRowBlocks[j] + size_t(x) * hsf;
+				for (uint v = 0; v < vsf; v++) {
+					for (uint h = 0; h < hsf; h++) {
+						const size_t block = firstBlock + v * scan.blockWidths[j] + h;
+						scan.lastCoefficients[j][block] = DecodeMCUComponent(b, *scan.dcTables[j], *scan.acTables[j], scan.coefficients[j] + block * 64, prevCoeff[j]);
+					}
+				}
+			}
+			if (++x == scan.mcuWidth) {
+				x = 0;
+				y++;
+			}
+		}
+	}
+
+	void JPGDecoder::PrepareMCUScan(const JPGFile& contents, int16_t* const coefficients[3], byte* const lastCoefficients[3], const size_t mcuRowBlocks[3], MCUScan& scan) {
+		scan.numComponents = contents.numComponents;
+		scan.mcuWidth = contents.mcuWidth;
+		scan.restartInterval = contents.restartInterval;
+		for (uint j = 0; j < contents.numComponents; j++) {
+			const ColorComponent& component = contents.components[j];
+			scan.dcTables[j] = &contents.huffmanDCTables[component.huffmanDCTableID];
+			scan.acTables[j] = &contents.huffmanACTables[component.huffmanACTableID];
+			scan.HSF[j] = component.HSF;
+			scan.VSF[j] = component.VSF;
+			scan.blockWidths[j] = component.blockWidth;
+			scan.coefficients[j] = coefficients[j];
+			scan.lastCoefficients[j] = lastCoefficients[j];
+			scan.mcuRowBlocks[j] = mcuRowBlocks[j];
+		}
+		const ColorComponent* components = contents.components;
+		const bool restarts = contents.restartInterval != 0;
+		const bool chroma1x1 = contents.numComponents == 3 &&
+			components[1].HSF == 1 && components[1].VSF == 1 && components[2].HSF == 1 && components[2].VSF == 1;
+		const uint luma = components[0].HSF * 10 + components[0].VSF;
+		if (contents.numComponents == 1) {
+			scan.decode = restarts ? DecodeMCUs<1, 1, 1, true> : DecodeMCUs<1, 1, 1, false>;
+		}
+		else if (chroma1x1 && luma == 11) {
+			scan.decode = restarts ? DecodeMCUs<3, 1, 1, true> : DecodeMCUs<3, 1, 1, false>;
+		}
+		else if (chroma1x1 && luma == 21) {
+			scan.decode = restarts ? DecodeMCUs<3, 2, 1, true> : DecodeMCUs<3, 2, 1, false>;
+		}
+		else if (chroma1x1 && luma == 12) {
+			scan.decode = restarts ? DecodeMCUs<3, 1, 2, true> : DecodeMCUs<3, 1, 2, false>;
+		}
+		else if (chroma1x1 && luma == 22) {
+			scan.decode = restarts ? DecodeMCUs<3, 2, 2, true> : DecodeMCUs<3, 2, 2, false>;
+		}
+		else {
+			scan.decode = restarts ? DecodeMCUs<0, 0, 0, true> : DecodeMCUs<0, 0, 0, false>;
 		}
-		return -1;
 	}
-	void JPGDecoder::DecodeMCUComponent(BitReader& b, HuffmanTable& huffmanDCTable, HuffmanTable& huffmanACTable, int MCUComponent[64], int& prevCoeff) {
+
+	// MCU rows or columns [first, end) that hold the output pixels [firstPixel, firstPixel + numPixels), and one more
+	// on either side if the upsampling needs the samples next to them
+	void MCURange(const uint firstPixel, const uint numPixels, const uint pixelsPerMCU, const uint numMCUs, const bool neighbours, uint& first, uint& end) {
+		first = firstPixel / pixelsPerMCU;
+		end = (firstPixel + numPixels - 1) / pixelsPerMCU + 1;
+		if (neighbours) {
+			first = first == 0 ? 0 : first - 1;
+			end = std::min(end + 1, numMCUs);
+		}
+	}
+
+	void JPGDecoder::DecodeFused(const OutputRows& output, JPGFile& contents, const DecodeOptions& options, DecodeMemory& memory) {
+		const uint numThreads = options.numThreads;
+		const bool progressive = contents.sofType == SOF2;
+		if (memory.arenas.empty()) {
+			memory.arenas.resize(1);
+		}
+		memory.arenas[0].Reset();
+		RowConverter converter(contents, options.upsampling, options.scale, memory.arenas[0]);
+
+		// only the MCU rows under the crop are decoded
+		const uint outputRowsPerMCU = 8 / options.scale * contents.maxVSF;
+		uint firstRow = 0;
+		uint endRow = 0;
+		MCURange(contents.outputY, contents.outputHeight, outputRowsPerMCU, contents.mcuHeight, converter.usesNeighbourRows(), firstRow, endRow);
+
+		// MCU rows that start with a restart interval can be decoded independently, so the image is
+		// split into bands of rows that start at such a row and decoded in parallel. Rows are streamed
+		// to a callback in order, so they are decoded on one thread.
+		const bool parallel = output.callback == nullptr && numThreads != 1;
+		const uint threads = numThreads == 0 ? ThreadPool::Default().NumThreads() : numThreads;
+		uint rowsPerBand = contents.mcuHeight;
+		uint bandOrigin = 0; // bands start at bandOrigin + band * rowsPerBand
+		if (parallel && !progressive && HasRestartOffsets(contents)) {
+			uint64_t a = contents.restartInterval;
+			uint64_t b = contents.mcuWidth;
+			while (b != 0) {
+				const uint64_t remainder = a % b;
+				a = b;
+				b = remainder;
+			}
+			const uint64_t leastCommonMultiple = uint64_t(contents.restartInterval) * contents.mcuWidth / a;
+			rowsPerBand = uint(std::min<uint64_t>(leastCommonMultiple / contents.mcuWidth, contents.mcuHeight));
+		}
+
+		// Without restart markers (or with too few of them) one thread huffman decodes the MCU rows into memory.planes
+		// while the others transform the rows it has finished. Progressive scans have decoded the coefficients of the
+		// whole image already. Either way any MCU row can start a band.
+		const bool huffmanThread = parallel && !progressive && rowsPerBand == contents.mcuHeight && threads > 1 && endRow - firstRow > 1;
+		// built in place, so decoding keeps not allocating once the Decoder's memory has grown
+		std::optional<CoefficientRows> coefficientRows;
+		if (progressive) {
+			coefficientRows.emplace(contents.planes, contents.mcuHeight);
+		}
+		else if (huffmanThread) {
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const size_t rowBlocks = size_t(contents.components[j].blockWidth) * contents.components[j].VSF;
+				memory.planes[j].coefficients.resize(rowBlocks * endRow * 64);
+				memory.planes[j].lastCoefficients.resize(rowBlocks * endRow);
+			}
+			coefficientRows.emplace(memory.planes, 0);
+		}
+		if (parallel && coefficientRows) {
+			const uint bandThreads = huffmanThread ? threads - 1 : threads;
+			rowsPerBand = (endRow - firstRow + bandThreads - 1) / bandThreads;
+			bandOrigin = firstRow;
+		}
+
+		// every band works in its own arena, bands that do not reach into the crop are left out
+		const uint firstBand = (firstRow - bandOrigin) / rowsPerBand;
+		const uint numBands = (endRow - 1 - bandOrigin) / rowsPerBand + 1 - firstBand;
+		if (memory.arenas.size() < numBands) {
+			memory.arenas.resize(numBands);
+		}
+		for (uint band = 1; band < numBands; band++) {
+			memory.arenas[band].Reset();
+		}
+		BandEdgeRows* edges = memory.arenas[0].Allocate<BandEdgeRows>(numBands);
+		auto bandStart = [&](const uint band) {
+			return bandOrigin + (firstBand + band) * rowsPerBand;
+		};
+
+		// std::ref keeps std::function from allocating a copy of the lambda
+		DecodeStats* const stats = CurrentStats();
+		const auto decodeBand = [&](const uint band) {
+			StatsScope statsScope(stats);
+			const uint startRow = bandStart(band);
+			const size_t offset = coefficientRows || startRow == 0 ? 0 : contents.restartOffsets[startRow * contents.mcuWidth / contents.restartInterval];
+			if (offset != 0) {
+				JPG_COUNT(restarts++)
+			}
+			BitReader b(contents.huffmanBitstream.data + offset, contents.huffmanBitstream.size - offset);
+			DecodeFusedRows(output, contents, b, coefficientRows ? 0 : startRow * contents.mcuWidth, std::max(startRow, firstRow), std::min(startRow + rowsPerBand, endRow),
+				options, memory.arenas[band], edges[band], coefficientRows ? &*coefficientRows : nullptr);
+		};
+
+		// the MCU rows above the crop are decoded too, for the DC predictions
+		const auto decodeHuffman = [&]() {
+			StatsScope statsScope(stats);
+			StageTimer timer;
+			try {
+				int16_t* coefficients[3] = { nullptr };
+				byte* lastCoefficients[3] = { nullptr };
+				size_t mcuRowBlocks[3] = { 0 };
+				for (uint j = 0; j < contents.numComponents; j++) {
+					coefficients[j] = memory.planes[j].coefficients.data();
+					lastCoefficients[j] = memory.planes[j].lastCoefficients.data();
+					mcuRowBlocks[j] = size_t(contents.components[j].blockWidth) * contents.components[j].VSF;
+				}
+				MCUScan scan;
+				PrepareMCUScan(contents, coefficients, lastCoefficients, mcuRowBlocks, scan);
+				BitReader b(contents.huffmanBitstream.data, contents.huffmanBitstream.size);
+				int prevCoeff[3] = { 0 };
+				for (uint y = 0; y < endRow; y++) {
+					scan.decode(b, scan, y * contents.mcuWidth, (y + 1) * contents.mcuWidth, 0, prevCoeff);
+					coefficientRows->decoded(y + 1);
+				}
+			}
+			catch (...) {
+				coefficientRows->fail();
+				throw;
+			}
+			timer.lap(&StageTimes::huffman);
+		};
+
+		if (huffmanThread) {
+			// task 0 is taken first, so the bands never wait for a huffman decoding that has not started
+			const auto decodeTask = [&](const uint task) {
+				if (task == 0) {
+					decodeHuffman();
+				}
+				else {
+					decodeBand(task - 1);
+				}
+			};
+			ThreadPool::Default().ParallelFor(numBands + 1, std::ref(decodeTask), threads);
+		}
+		else if (numBands == 1) {
+			decodeBand(0);
+			return;
+		}
+		else {
+			ThreadPool::Default().ParallelFor(numBands, std::ref(decodeBand), numThreads);
+		}
+
+		// the output rows on either side of an edge between two bands need sample rows of both
+		if (!converter.usesNeighbourRows()) {
+			return;
+		}
+		for (uint band = 1; band < numBands; band++) {
+			const uint outputRow = bandStart(band) * outputRowsPerMCU;
+			const byte* above[3] = { nullptr };
+			const byte* below[3] = { nullptr };
+			for (uint j = 0; j < contents.numComponents; j++) {
+				above[j] = edges[band - 1].last[j];
+				below[j] = edges[band].first[j];
+			}
+			converter.convert(above, below, outputRow - 1, output);
+			converter.convert(below, above, outputRow, output);
+		}
+	}
+
+	// Takes the MCU rows firstRow to endRow - 1 through the IDCT, upsampling and color conversion, one after another.
+	// Output rows that need a sample row of the band above or below are left out, their sample rows are stored in
+	// edges instead.
+	class FusedRows {
+		const OutputRows& output;
+		const JPGFile& contents;
+		RowConverter converter;
+		const uint firstRow;
+		const uint endRow;
+		BandEdgeRows& edges;
+		const bool neighbourRows;
+		const uint outputRowsPerMCU;
+
+		// one MCU row of samples per component, and the last sample row of the MCU row above
+		byte* samples[3] = { nullptr };
+		byte* previousRows[3] = { nullptr };
+		size_t strides[3] = { 0 };
+		uint blockSizes[3] = { 0 };
+		uint sampleRowsPerMCU[3] = { 0 };
+		DequantizeIDCTKernel dequantizeIDCT[3] = { nullptr };
+	public:
+		// only the MCU columns under the crop are transformed
+		uint firstColumn = 0;
+		uint endColumn = 0;
+
+		// the rows are allocated from arena
+		FusedRows(const OutputRows& output, const JPGFile& contents, const DecodeOptions& options, const uint firstRow, const uint endRow, Arena& arena, BandEdgeRows& edges) :
+			output(output),
+			contents(contents),
+			converter(contents, options.upsampling, options.scale, arena),
+			firstRow(firstRow),
+			endRow(endRow),
+			edges(edges),
+			neighbourRows(converter.usesNeighbourRows()),
+			outputRowsPerMCU(8 / options.scale * contents.maxVSF)
+		{
+			MCURange(contents.outputX, contents.outputWidth, 8 / options.scale * contents.maxHSF, contents.mcuWidth, converter.usesNeighbourColumns(), firstColumn, endColumn);
+			const Kernels& kernels = GetKernels();
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const ColorComponent& component = contents.components[j];
+				blockSizes[j] = ComponentBlockSize(contents, j, options.scale);
+				sampleRowsPerMCU[j] = component.VSF * blockSizes[j];
+				dequantizeIDCT[j] = GetDequantizeIDCTKernel(kernels, blockSizes[j]);
+				strides[j] = component.blockWidth * blockSizes[j];
+				samples[j] = arena.Allocate<byte>(strides[j] * sampleRowsPerMCU[j]);
+				previousRows[j] = arena.Allocate<byte>(strides[j]);
+				edges.first[j] = edges.last[j] = nullptr;
+				if (neighbourRows) {
+					edges.first[j] = arena.Allocate<byte>(strides[j]);
+					edges.last[j] = arena.Allocate<byte>(strides[j]);
+				}
+			}
+		}
+
+		// transforms MCU row y (the one after the last one), coefficients point to the first block of the row of each
+		// component and lastCoefficients to the zigzag index of its last non-zero coefficient (nullptr if unknown)
+		void transform(const uint y, const int16_t* const coefficients[3], const byte* const lastCoefficients[3], StageTimer& timer) {
+			// dequantization and IDCT
+			for (uint j = 0; j < OutputComponents(contents, output.format); j++) {
+				const ColorComponent& component = contents.components[j];
+				const uint firstBlock = firstColumn * component.HSF;
+				const uint numBlocks = std::min(endColumn * component.HSF, component.blockWidth) - firstBlock;
+				for (uint v = 0; v < component.VSF; v++) {
+					const uint block = v * component.blockWidth + firstBlock;
+					dequantizeIDCT[j](coefficients[j] + block * 64, lastCoefficients[j] ? lastCoefficients[j] + block : nullptr, contents.qtTables[component.quantizationTableID].table,
+						&samples[j][v * blockSizes[j] * strides[j] + firstBlock * blockSizes[j]], strides[j], numBlocks);
+				}
+			}
+			timer.lap(&StageTimes::idct);
+
+			// upsampling and color conversion
+			const byte* nearRows[3] = { nullptr };
+			const byte* farRows[3] = { nullptr };
+			auto sampleRow = [&](const uint j, const uint row) -> const byte* {
+				const uint firstSampleRow = y * sampleRowsPerMCU[j];
+				return row < firstSampleRow ? previousRows[j] : &samples[j][(row - firstSampleRow) * strides[j]];
+			};
+			const uint firstOutputRow = y * outputRowsPerMCU;
+
+			// the last output row of the MCU row above had to wait for the first sample rows of this one
+			if (neighbourRows && y != firstRow) {
+				for (uint j = 0; j < contents.numComponents; j++) {
+					nearRows[j] = sampleRow(j, converter.nearRow(j, firstOutputRow - 1));
+					farRows[j] = sampleRow(j, converter.farRow(j, firstOutputRow - 1));
+				}
+				converter.convert(nearRows, farRows, firstOutputRow - 1, output);
+			}
+
+			for (uint outputRow = firstOutputRow; outputRow < firstOutputRow + outputRowsPerMCU; outputRow++) {
+				bool ready = true;
+				for (uint j = 0; j < contents.numComponents; j++) {
+					const uint firstSampleRow = y * sampleRowsPerMCU[j];
+					const uint farRow = converter.farRow(j, outputRow);
+					// rows of the band above are not available, rows of the next MCU row are not decoded yet
+					if ((farRow < firstSampleRow && y == firstRow) || farRow >= firstSampleRow + sampleRowsPerMCU[j]) {
+						ready = false;
+						break;
+					}
+					nearRows[j] = sampleRow(j, converter.nearRow(j, outputRow));
+					farRows[j] = sampleRow(j, farRow);
+				}
+				if (ready) {
+					converter.convert(nearRows, farRows, outputRow, output);
+				}
+			}
+
+			if (neighbourRows) {
+				for (uint j = 0; j < contents.numComponents; j++) {
+					const byte* lastRow = &samples[j][(sampleRowsPerMCU[j] - 1) * strides[j]];
+					if (y == firstRow) {
+						std::copy(samples[j], samples[j] + strides[j], edges.first[j]);
+					}
+					if (y == endRow - 1) {
+						std::copy(lastRow, lastRow + strides[j], edges.last[j]);
+					}
+					std::copy(lastRow, lastRow + strides[j], previousRows[j]);
+				}
+			}
+			timer.lap(&StageTimes::color);
+		}
+	};
+
+	// decodes the MCU rows firstRow to endRow - 1, b has to be at the start of MCU bitstreamMCU, which is at or before
+	// firstRow (unless the coefficients come from coefficientRows). Output rows that need a sample row of the band above
+	// or below are left out, their sample rows are stored in edges instead.
+	void JPGDecoder::DecodeFusedRows(const OutputRows& output, JPGFile& contents, BitReader& b, const uint bitstreamMCU, const uint firstRow, const uint endRow,
+		const DecodeOptions& options, Arena& arena, BandEdgeRows& edges, const CoefficientRows* coefficientRows) {
+		FusedRows rows(output, contents, options, firstRow, endRow, arena, edges);
+		const uint mcuWidth = contents.mcuWidth;
+
+		// one MCU row of coefficients per component, unless they come from coefficientRows
+		int16_t* coefficients[3] = { nullptr };
+		byte* lastCoefficients[3] = { nullptr };
+		for (uint j = 0; j < contents.numComponents; j++) {
+			const ColorComponent& component = contents.components[j];
+			if (coefficientRows == nullptr) {
+				coefficients[j] = arena.Allocate<int16_t>(component.blockWidth * component.VSF * 64);
+				lastCoefficients[j] = arena.Allocate<byte>(component.blockWidth * component.VSF);
+			}
+		}
+
+		int prevCoeff[3] = { 0 };
+
+		// MCU that b is at, and the MCU it started at (which has no restart marker in front of it)
+		uint nextMCU = bitstreamMCU;
+		uint resumeMCU = bitstreamMCU;
+		const uint restartInterval = contents.restartInterval;
+		const bool canSkip = HasRestartOffsets(contents);
+		// every MCU row is decoded into the same coefficients
+		const size_t mcuRowBlocks[3] = { 0 };
+		MCUScan scan;
+		PrepareMCUScan(contents, coefficients, lastCoefficients, mcuRowBlocks, scan);
+
+		StageTimer timer;
+		for (uint y = firstRow; y < endRow; y++) {
+			// huffman decoding (or waiting for the thread that does it)
+			// (progressive JPGs do not know where the coefficients of their blocks end)
+			if (coefficientRows != nullptr && !coefficientRows->wait(y)) {
+				return;
+			}
+			const int16_t* rowCoefficients[3] = { nullptr };
+			const byte* rowLastCoefficients[3] = { nullptr };
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const size_t rowBlocks = size_t(contents.components[j].blockWidth) * contents.components[j].VSF;
+				if (coefficientRows != nullptr) {
+					const ComponentPlane& plane = coefficientRows->plane(j);
+					rowCoefficients[j] = &plane.coefficients[y * rowBlocks * 64];
+					rowLastCoefficients[j] = plane.lastCoefficients.empty() ? nullptr : &plane.lastCoefficients[y * rowBlocks];
+				}
+				else {
+					rowCoefficients[j] = coefficients[j];
+					rowLastCoefficients[j] = lastCoefficients[j];
+				}
+			}
+			if (coefficientRows == nullptr) {
+				// MCUs in front of the crop are jumped over with the restart offsets where possible, the rest has to
+				// be huffman decoded for the DC predictions (into columns that are not transformed)
+				const uint cropMCU = y * mcuWidth + rows.firstColumn;
+				if (canSkip && cropMCU / restartInterval * restartInterval > nextMCU) {
+					const uint interval = cropMCU / restartInterval;
+					const size_t offset = contents.restartOffsets[interval];
+					b = BitReader(contents.huffmanBitstream.data + offset, contents.huffmanBitstream.size - offset);
+					nextMCU = resumeMCU = interval * restartInterval;
+					prevCoeff[0] = prevCoeff[1] = prevCoeff[2] = 0;
+					JPG_COUNT(restarts++)
+				}
+				if (nextMCU < y * mcuWidth + rows.endColumn) {
+					scan.decode(b, scan, nextMCU, y * mcuWidth + rows.endColumn, resumeMCU, prevCoeff);
+					nextMCU = y * mcuWidth + rows.endColumn;
+				}
+			}
+			timer.lap(&StageTimes::huffman);
+
+			rows.transform(y, rowCoefficients, rowLastCoefficients, timer);
+		}
+	}
+
+	void JPGDecoder::DecodeHuffmanData(ComponentPlane planes[], JPGFile& contents, const uint numThreads) {
+		const uint numMCUs = contents.mcuWidth * contents.mcuHeight;
+
+		// every restart interval starts with fresh DC predictions, so they can be decoded independently
+		if (numThreads != 1 && HasRestartOffsets(contents)) {
+			DecodeStats* const stats = CurrentStats();
+			const auto decodeInterval = [&](const uint interval) {
+				StatsScope statsScope(stats);
+				if (interval != 0) {
+					JPG_COUNT(restarts++)
+				}
+				const size_t offset = contents.restartOffsets[interval];
+				BitReader b(contents.huffmanBitstream.data + offset, contents.huffmanBitstream.size - offset);
+				const uint firstMCU = interval * contents.restartInterval;
+				DecodeHuffmanMCUs(planes, contents, b, firstMCU, std::min(firstMCU + contents.restartInterval, numMCUs));
+			};
+			ThreadPool::Default().ParallelFor(uint(contents.restartOffsets.size()), std::ref(decodeInterval), numThreads);
+			return;
+		}
+
+		BitReader b(contents.huffmanBitstream.data, contents.huffmanBitstream.size);
+		DecodeHuffmanMCUs(planes, contents, b, 0, numMCUs);
+	}
+	void JPGDecoder::DecodeHuffmanMCUs(ComponentPlane planes[], JPGFile& contents, BitReader& b, const uint firstMCU, const uint endMCU) {
+		int16_t* coefficients[3] = { nullptr };
+		byte* lastCoefficients[3] = { nullptr };
+		size_t mcuRowBlocks[3] = { 0 };
+		for (uint j = 0; j < contents.numComponents; j++) {
+			coefficients[j] = planes[j].coefficients.data();
+			lastCoefficients[j] = planes[j].lastCoefficients.data();
+			mcuRowBlocks[j] = size_t(contents.components[j].blockWidth) * contents.components[j].VSF;
+		}
+		MCUScan scan;
+		PrepareMCUScan(contents, coefficients, lastCoefficients, mcuRowBlocks, scan);
+		int prevCoeff[3] = { 0 };
+		scan.decode(b, scan, firstMCU, endMCU, firstMCU, prevCoeff);
+	}
+	byte GetNextSymbol(BitReader& b, const HuffmanTable& huffmanTable) {
+		JPG_COUNT(symbols++)
+		const uint bits = b.peek(16);
+
+		// fast path: codes of up to HuffmanLookupBits bits
+		const uint16_t entry = huffmanTable.lookup[bits >> (16 - HuffmanLookupBits)];
+		if (entry != 0) {
+			b.consume(entry >> 8);
+			return entry & 0xFF;
+		}
+
+		// slow path: longer codes are compared against the largest code of each length
+		for (uint i = HuffmanLookupBits; i < 16; i++) {
+			const int code = bits >> (15 - i);
+			if (code <= huffmanTable.maxCode[i]) {
+				b.consume(i + 1);
+				return huffmanTable.symbols[code + huffmanTable.valueOffset[i]];
+			}
+		}
+		return -1;
+	}
+	// reads a length bit coefficient and maps it to its signed value
+	inline int ReadCoefficient(BitReader& b, const uint length) {
+		if (length == 0) {
+			return 0;
+		}
+		const int coeff = b.readBits(length);
+		return coeff < (1 << (length - 1)) ? coeff - (1 << length) + 1 : coeff;
+	}
+	byte JPGDecoder::DecodeMCUComponent(BitReader& b, const HuffmanTable& huffmanDCTable, const HuffmanTable& huffmanACTable, int16_t MCUComponent[64], int& prevCoeff) {
 		// Read the DC symbol for this mcu component
 		byte length = GetNextSymbol(b, huffmanDCTable);
 		if (length == (byte)-1) {
@@ -523,18 +1998,13 @@ namespace JPG {
 		if (length > 11) {
 			throw std::length_error("Error - Error - DC lengths can not be longer than 11");
 		}
-		int coeff = b.readBits(length);
-		if (coeff == -1) {
-			throw std::invalid_argument("Error - Something went wrong when trying to read a symbol (DC 2)");
-		}
-		if (length != 0 && coeff < (1 << (length - 1))) {
-			coeff -= (1 << length) - 1;
-		}
-		MCUComponent[0] = coeff + prevCoeff;
-		prevCoeff = MCUComponent[0];
+		prevCoeff += ReadCoefficient(b, length);
+		MCUComponent[0] = int16_t(prevCoeff);
 		
 		// Read the AC symbols for this MCU component
 		uint i = 1;
+		JPG_COUNT(blocks++)
+		uint lastCoefficient = 0;
 		while (i < 64) {
 			byte symbol = GetNextSymbol(b, huffmanACTable);
 			if (symbol == (byte)-1) {
@@ -544,87 +2014,650 @@ namespace JPG {
 				for (; i < 64; ++i) {
 					MCUComponent[MCUMap[i]] = 0;
 				}
-				return;
+				break;
 			}
 
 			byte numZeros = symbol >> 4;
 			byte coeffLength = symbol & 0x0F;
-			coeff = 0;
 			if (coeffLength > 10) {
 				throw std::length_error("Error - AC lengths can not be longer than 10");
 			}
 			if (symbol == 0xF0) {
 				numZeros = 16;
 			}
+			if (i + numZeros + (coeffLength != 0) > 64) {
+				throw std::length_error("Error - Invalid JPG (zero run goes past the end of the MCU component)");
+			}
 
 			for (uint j = 0; j < numZeros; ++j, ++i) {
 				MCUComponent[MCUMap[i]] = 0;
 			}
 
 			if (coeffLength != 0) {
-				coeff = b.readBits(coeffLength);
-				if (coeff == -1) {
-					throw std::invalid_argument("Error - Something went wrong when trying to read a symbol (AC 2)");
+				MCUComponent[MCUMap[i]] = int16_t(ReadCoefficient(b, coeffLength));
+				lastCoefficient = i;
+				i += 1;
+			}
+			JPG_COUNT(zeroRuns[numZeros]++)
+		}
+		JPG_COUNT(blocksByLastCoefficient[lastCoefficient]++)
+
+		if (b.overrun()) {
+			throw std::invalid_argument("Error - Invalid JPG File (huffman coded bitstream ended in the middle of an MCU)");
+		}
+		return byte(lastCoefficient);
+	}
+	// progressive scans: the first scan of a coefficient sends its upper bits, refinement scans one more bit each
+	void DecodeDCFirst(BitReader& b, const HuffmanTable& huffmanTable, int16_t block[64], int& prevCoeff, const uint low) {
+		const byte length = GetNextSymbol(b, huffmanTable);
+		if (length == (byte)-1) {
+			throw std::invalid_argument("Error - Something went wrong when trying to read a symbol (DC 1)");
+		}
+		if (length > 11) {
+			throw std::length_error("Error - Error - DC lengths can not be longer than 11");
+		}
+		prevCoeff += ReadCoefficient(b, length);
+		block[0] = prevCoeff * (1 << low);
+	}
+	void DecodeDCRefinement(BitReader& b, int16_t block[64], const uint low) {
+		if (b.readBits(1)) {
+			block[0] |= 1 << low;
+		}
+	}
+	// eobRun counts the following blocks of the band that have no coefficients in this scan
+	void DecodeACFirst(BitReader& b, const HuffmanTable& huffmanTable, int16_t block[64], const uint start, const uint end, const uint low, uint& eobRun) {
+		if (eobRun > 0) {
+			eobRun--;
+			return;
+		}
+		for (uint i = start; i <= end; i++) {
+			const byte symbol = GetNextSymbol(b, huffmanTable);
+			if (symbol == (byte)-1) {
+				throw std::invalid_argument("Error - Something went wrong when trying to read a symbol (AC 1)");
+			}
+			const byte numZeros = symbol >> 4;
+			const byte coeffLength = symbol & 0x0F;
+			if (coeffLength == 0) {
+				if (numZeros < 15) {
+					eobRun = (1u << numZeros) - 1 + b.readBits(numZeros);
+					break;
+				}
+				i += 15;
+				continue;
+			}
+			if (coeffLength > 10) {
+				throw std::length_error("Error - AC lengths can not be longer than 10");
+			}
+			i += numZeros;
+			if (i > end) {
+				throw std::length_error("Error - Invalid JPG (zero run goes past the end of the spectral band)");
+			}
+			block[MCUMap[i]] = ReadCoefficient(b, coeffLength) * (1 << low);
+		}
+	}
+	// refines the coefficients that are already nonzero with one bit each and adds the ones that become nonzero
+	void DecodeACRefinement(BitReader& b, const HuffmanTable& huffmanTable, int16_t block[64], const uint start, const uint end, const uint low, uint& eobRun) {
+		const int positive = 1 << low;
+		const int negative = -1 * (1 << low);
+		auto refine = [&](int16_t& coeff) {
+			if (b.readBits(1) && (coeff & positive) == 0) {
+				coeff += coeff >= 0 ? positive : negative;
+			}
+		};
+
+		uint i = start;
+		if (eobRun == 0) {
+			for (; i <= end; i++) {
+				const byte symbol = GetNextSymbol(b, huffmanTable);
+				if (symbol == (byte)-1) {
+					throw std::invalid_argument("Error - Something went wrong when trying to read a symbol (AC 1)");
 				}
-				if (coeff < (1 << (coeffLength - 1))) {
-					coeff -= (1 << coeffLength) - 1;
+				int numZeros = symbol >> 4;
+				const byte coeffLength = symbol & 0x0F;
+				int newCoeff = 0;
+				if (coeffLength != 0) {
+					if (coeffLength != 1) {
+						throw std::length_error("Error - Invalid JPG (refinement coefficients have to be 1 bit long)");
+					}
+					newCoeff = b.readBits(1) ? positive : negative;
+				}
+				else if (numZeros != 15) {
+					eobRun = (1u << numZeros) + b.readBits(numZeros);
+					break;
+				}
+
+				// skip numZeros coefficients that are still zero, refining the nonzero ones on the way
+				for (; i <= end; i++) {
+					int16_t& coeff = block[MCUMap[i]];
+					if (coeff != 0) {
+						refine(coeff);
+					}
+					else if (--numZeros < 0) {
+						break;
+					}
+				}
+				if (newCoeff != 0) {
+					if (i > end) {
+						throw std::length_error("Error - Invalid JPG (zero run goes past the end of the spectral band)");
+					}
+					block[MCUMap[i]] = newCoeff;
 				}
-				MCUComponent[MCUMap[i]] = coeff;
-				i += 1;
 			}
 		}
+		if (eobRun > 0) {
+			for (; i <= end; i++) {
+				int16_t& coeff = block[MCUMap[i]];
+				if (coeff != 0) {
+					refine(coeff);
+				}
+			}
+			eobRun--;
+		}
 	}
-	void JPGDecoder::DequantizeMCUs(MCU mcus[], JPGFile& contents) {
-		for (uint i = 0; i < contents.mcuWidth * contents.mcuHeight; i++) {
+
+	void JPGDecoder::DecodeScans(JPGFile& contents, const uint numScans) {
+		// the first scan starts from zero coefficients, the planes may still hold the ones of the last image
+		if (contents.scansDecoded == 0) {
 			for (uint j = 0; j < contents.numComponents; j++) {
-				for (uint k = 0; k < 64; k++) {
-					mcus[i][j][k] *= contents.qtTables[contents.components[j].quantizationTableID].table[k];
-				}
-			}
-		}
-	}
-	void JPGDecoder::InverseDiscreteCosineTransform(MCU MCUComponent[], JPGFile& contents) {
-		for (uint k = 0; k < contents.mcuWidth * contents.mcuHeight; k++) {
-			for (uint l = 0; l < contents.numComponents; l++) {
-				int result[64] = { 0 };
-				for (uint x = 0; x < 8; x++) {
-					for (uint y = 0; y < 8; y++) {
-						float sum = 0;
-						for (uint i = 0; i < 8; i++) {
-							for (uint j = 0; j < 8; j++) {
-								const float ci = i == 0 ? (1.f / std::sqrt(2.f)) : 1;
-								const float cj = j == 0 ? (1.f / std::sqrt(2.f)) : 1;
-								const float idct = ci * cj * MCUComponent[k][l][i * 8 + j] *
-									(float)std::cos((((2.0 * y) + 1.0) * 3.14159265 * i) / 16.0) *
-									(float)std::cos((((2.0 * x) + 1.0) * 3.14159265 * j) / 16.0);
-								sum += idct;
-							}
+				contents.planes[j].coefficients.assign(size_t(contents.components[j].blockWidth) * contents.components[j].blockHeight * 64, 0);
+			}
+		}
+		const uint endScan = numScans == 0 ? uint(contents.scans.size()) : std::min(numScans, uint(contents.scans.size()));
+		for (; contents.scansDecoded < endScan; contents.scansDecoded++) {
+			DecodeProgressiveScan(contents, contents.scans[contents.scansDecoded]);
+		}
+	}
+	void JPGDecoder::DecodeProgressiveScan(JPGFile& contents, const Scan& scan) {
+		BitReader b(contents.huffmanBitstream.data + scan.offset, scan.length);
+		const bool dcScan = scan.startOfSelection == 0;
+		const bool refinement = scan.successiveApproximationHigh != 0;
+		const uint low = scan.successiveApproximationLow;
+
+		// a scan of a single component is not interleaved, its MCUs are single blocks that only cover the component
+		uint mcusPerRow = contents.mcuWidth;
+		uint numMCUs = contents.mcuWidth * contents.mcuHeight;
+		if (scan.numComponents == 1) {
+			const ColorComponent& component = contents.components[scan.components[0]];
+			mcusPerRow = (component.width + 7) / 8;
+			numMCUs = mcusPerRow * ((component.height + 7) / 8);
+		}
+
+		int prevCoeff[3] = { 0 };
+		uint eobRun = 0;
+		for (uint i = 0; i < numMCUs; i++) {
+			if (scan.restartInterval != 0 && i != 0 && i % scan.restartInterval == 0) {
+				b.restart(RST0 + ((i / scan.restartInterval - 1) & 7));
+				prevCoeff[0] = prevCoeff[1] = prevCoeff[2] = 0;
+				eobRun = 0;
+			}
+			const uint x = i % mcusPerRow;
+			const uint y = i / mcusPerRow;
+			for (uint c = 0; c < scan.numComponents; c++) {
+				const ColorComponent& component = contents.components[scan.components[c]];
+				const uint hsf = scan.numComponents == 1 ? 1 : component.HSF;
+				const uint vsf = scan.numComponents == 1 ? 1 : component.VSF;
+				for (uint v = 0; v < vsf; v++) {
+					for (uint h = 0; h < hsf; h++) {
+						const size_t block = size_t(y * vsf + v) * component.blockWidth + x * hsf + h;
+						int16_t* coefficients = &contents.planes[scan.components[c]].coefficients[block * 64];
+						if (dcScan && !refinement) {
+							DecodeDCFirst(b, scan.huffmanTables[c], coefficients, prevCoeff[c], low);
+						}
+						else if (dcScan) {
+							DecodeDCRefinement(b, coefficients, low);
+						}
+						else if (!refinement) {
+							DecodeACFirst(b, scan.huffmanTables[c], coefficients, scan.startOfSelection, scan.endOfSelection, low, eobRun);
+						}
+						else {
+							DecodeACRefinement(b, scan.huffmanTables[c], coefficients, scan.startOfSelection, scan.endOfSelection, low, eobRun);
 						}
-						sum /= 4;
-						result[y * 8 + x] = (int)sum;
 					}
 				}
-				for (uint x = 0; x < 8; x++) {
-					for (uint y = 0; y < 8; y++) {
-						MCUComponent[k][l][y * 8 + x] = result[y * 8 + x];
+			}
+			if (b.overrun()) {
+				throw std::invalid_argument("Error - Invalid JPG File (huffman coded bitstream ended in the middle of an MCU)");
+			}
+		}
+	}
+	// direct evaluation of the IDCT formula, kept as a reference to check the integer IDCT against
+	void ReferenceIDCTBlock(int block[64]) {
+		int result[64] = { 0 };
+		for (uint x = 0; x < 8; x++) {
+			for (uint y = 0; y < 8; y++) {
+				float sum = 0;
+				for (uint i = 0; i < 8; i++) {
+					for (uint j = 0; j < 8; j++) {
+						const float ci = i == 0 ? (1.f / std::sqrt(2.f)) : 1;
+						const float cj = j == 0 ? (1.f / std::sqrt(2.f)) : 1;
+						const float idct = ci * cj * block[i * 8 + j] *
+							(float)std::cos((((2.0 * y) + 1.0) * 3.14159265 * i) / 16.0) *
+							(float)std::cos((((2.0 * x) + 1.0) * 3.14159265 * j) / 16.0);
+						sum += idct;
 					}
 				}
+				sum /= 4;
+				result[y * 8 + x] = (int)std::round(sum);
 			}
 		}
+		for (uint i = 0; i < 64; i++) {
+			block[i] = result[i];
+		}
 	}
-	void JPGDecoder::YCbCrToRGB(MCU mcus[], JPGFile& contents) {
-		for (uint i = 0; i < contents.mcuWidth * contents.mcuHeight; i++) {
-			for (uint x = 0; x < 8; x++) {
-				for (uint y = 0; y < 8; y++) {
-					int r = int(mcus[i].y[y * 8 + x] + 1.402f * (mcus[i].cr[y * 8 + x])) + 128;
-					int g = int(mcus[i].y[y * 8 + x] - 0.344136f * (mcus[i].cb[y * 8 + x]) - 0.714136f * (mcus[i].cr[y * 8 + x])) + 128;
-					int b = int(mcus[i].y[y * 8 + x] + 1.772f * (mcus[i].cb[y * 8 + x])) + 128;
 
-					mcus[i].y[y * 8 + x] = std::min(std::max(r, 255), 255);
-					mcus[i].cb[y * 8 + x] = std::min(std::max(g, 255), 255);
-					mcus[i].cr[y * 8 + x] = std::min(std::max(b, 255), 255);
+	// dequantizes each block into a temporary (dequantized coefficients do not always fit in 16 bits) and transforms
+	// it. At reduced scales the full size block is averaged down, which is what the reduced IDCTs approximate.
+	void JPGDecoder::InverseDiscreteCosineTransform(ComponentPlane planes[], JPGFile& contents, const IDCTMethod method, const uint scale) {
+		void (*idctBlock)(int[64]) = method == IDCTMethod::Reference ? ReferenceIDCTBlock : IntegerIDCTBlock;
+		for (uint j = 0; j < contents.numComponents; j++) {
+			const ColorComponent& component = contents.components[j];
+			const uint16_t* table = contents.qtTables[component.quantizationTableID].table;
+			const uint blockSize = ComponentBlockSize(contents, j, scale);
+			const uint factor = 8 / blockSize;
+			const size_t stride = component.blockWidth * blockSize;
+			for (uint y = 0; y < component.blockHeight; y++) {
+				for (uint x = 0; x < component.blockWidth; x++) {
+					const int16_t* coefficients = &planes[j].coefficients[(size_t(y) * component.blockWidth + x) * 64];
+					int block[64];
+					for (uint k = 0; k < 64; k++) {
+						block[k] = coefficients[k] * table[k];
+					}
+					idctBlock(block);
+					byte* output = &planes[j].samples[y * blockSize * stride + x * blockSize];
+					for (uint k = 0; k < blockSize * blockSize; k++) {
+						int sum = 0;
+						for (uint i = 0; i < factor * factor; i++) {
+							sum += std::min(std::max(block[((k / blockSize) * factor + i / factor) * 8 + (k % blockSize) * factor + i % factor] + 128, 0), 255);
+						}
+						output[(k / blockSize) * stride + k % blockSize] = byte((sum + factor * factor / 2) / (factor * factor));
+					}
 				}
 			}
 		}
 	}
+	// dequantization and integer IDCT in one step, done for a whole block row of a component at a time
+	// with the fastest kernel this CPU supports
+	void JPGDecoder::DequantizeIDCT(ComponentPlane planes[], JPGFile& contents, const uint scale) {
+		const Kernels& kernels = GetKernels();
+		for (uint j = 0; j < contents.numComponents; j++) {
+			const ColorComponent& component = contents.components[j];
+			const uint blockSize = ComponentBlockSize(contents, j, scale);
+			const DequantizeIDCTKernel dequantizeIDCT = GetDequantizeIDCTKernel(kernels, blockSize);
+			const size_t stride = component.blockWidth * blockSize;
+			// progressive JPGs do not know where the coefficients of their blocks end
+			const byte* lastCoefficients = planes[j].lastCoefficients.empty() ? nullptr : planes[j].lastCoefficients.data();
+			for (uint y = 0; y < component.blockHeight; y++) {
+				const size_t block = size_t(y) * component.blockWidth;
+				dequantizeIDCT(&planes[j].coefficients[block * 64], lastCoefficients ? lastCoefficients + block : nullptr, contents.qtTables[component.quantizationTableID].table,
+					&planes[j].samples[y * blockSize * stride], stride, component.blockWidth);
+			}
+		}
+	}
+	void JPGDecoder::YCbCrToRGB(const ComponentPlane planes[], JPGFile& contents, const OutputRows& output, const Upsampling upsampling, const uint scale, Arena& arena) {
+		RowConverter converter(contents, upsampling, scale, arena);
+		const byte* nearRows[3] = { nullptr };
+		const byte* farRows[3] = { nullptr };
+		for (uint outputRow = contents.outputY; outputRow < contents.outputY + contents.outputHeight; outputRow++) {
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const size_t stride = contents.components[j].blockWidth * ComponentBlockSize(contents, j, scale);
+				nearRows[j] = &planes[j].samples[converter.nearRow(j, outputRow) * stride];
+				farRows[j] = &planes[j].samples[converter.farRow(j, outputRow) * stride];
+			}
+			converter.convert(nearRows, farRows, outputRow, output);
+		}
+	}
+
+
+	// --- Decoder --- \\
+
+
+
+	const JPGFile& Decoder::Read(const byte* data, const size_t size) {
+		JPGDecoder::ReadJPG(data, size, contents);
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		return contents;
+	}
+
+	const JPGFile& Decoder::Read(const std::string& fileName) {
+#ifdef __linux__
+		// plain reads into the reused buffer, a stream would allocate its own buffer for every file
+		const int fd = open(fileName.c_str(), O_RDONLY);
+		if (fd < 0) {
+			throw std::invalid_argument("Error - Cannot open file! (Is the filename correct?)");
+		}
+		struct stat status;
+		if (fstat(fd, &status) != 0) {
+			close(fd);
+			throw std::invalid_argument("Error - Cannot read file");
+		}
+		const size_t size = size_t(status.st_size);
+		fileBuffer.resize(std::max(fileBuffer.size(), size));
+		size_t done = 0;
+		while (done < size) {
+			const ssize_t count = read(fd, fileBuffer.data() + done, size - done);
+			if (count <= 0) {
+				break;
+			}
+			done += size_t(count);
+		}
+		close(fd);
+		if (done != size) {
+			throw std::invalid_argument("Error - Cannot read file");
+		}
+#else
+		std::ifstream file(fileName, std::ios::in | std::ios::binary | std::ios::ate);
+		if (!file.is_open()) {
+			throw std::invalid_argument("Error - Cannot open file! (Is the filename correct?)");
+		}
+		const size_t size = size_t(file.tellg());
+		fileBuffer.resize(std::max(fileBuffer.size(), size));
+		file.seekg(0);
+		file.read(reinterpret_cast<char*>(fileBuffer.data()), size);
+		if (!file) {
+			throw std::invalid_argument("Error - Cannot read file");
+		}
+#endif
+		return Read(fileBuffer.data(), size);
+	}
+
+	const byte* Decoder::Decode() {
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		const size_t stride = size_t(contents.outputWidth) * JPGDecoder::BytesPerPixel(options.pixelFormat);
+		pixels.resize(std::max(pixels.size(), stride * contents.outputHeight));
+		Decode(pixels.data(), stride);
+		return pixels.data();
+	}
+
+	void Decoder::Decode(byte* pixels, const size_t stride) {
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		if (pixels == nullptr || stride < size_t(contents.outputWidth) * JPGDecoder::BytesPerPixel(options.pixelFormat)) {
+			throw std::invalid_argument("Error - Output buffer is missing or its stride is smaller than a row of pixels");
+		}
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.pixels = pixels;
+		output.stride = stride;
+		JPGDecoder::Decode(contents, output, options, memory);
+	}
+
+	void Decoder::DecodeRows(const RowCallback& rowCallback) {
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.callback = &rowCallback;
+		JPGDecoder::Decode(contents, output, options, memory);
+	}
+
+
+
+	// --- StreamDecoder --- \\
+
+
+
+	// what StreamDecoder keeps between the chunks of data while it decodes the scan of a baseline JPG
+	struct StreamRows {
+		OutputRows output;
+		BandEdgeRows edges;
+		FusedRows rows;
+		MCUScan scan;
+		BitReader reader; // at the start of MCU row nextRow, reading from StreamDecoder::buffer
+		int prevCoeff[3] = { 0 };
+		int16_t* coefficients[3] = { nullptr }; // one MCU row of each component
+		byte* lastCoefficients[3] = { nullptr };
+		uint nextRow = 0;
+		uint firstRow = 0; // the MCU rows from firstRow to endRow - 1 are transformed, the rows above are only huffman decoded
+		uint endRow = 0;
+
+		StreamRows(const OutputRows& output, const JPGFile& contents, const DecodeOptions& options, const uint firstRow, const uint endRow, Arena& arena) :
+			output(output),
+			rows(this->output, contents, options, firstRow, endRow, arena, edges),
+			reader(nullptr, 0),
+			firstRow(firstRow),
+			endRow(endRow)
+		{
+			for (uint j = 0; j < contents.numComponents; j++) {
+				const ColorComponent& component = contents.components[j];
+				coefficients[j] = arena.Allocate<int16_t>(component.blockWidth * component.VSF * 64);
+				lastCoefficients[j] = arena.Allocate<byte>(component.blockWidth * component.VSF);
+			}
+		}
+	};
+
+	StreamDecoder::StreamDecoder(const RowCallback& rowCallback, const DecodeOptions& options) :
+		rowCallback(rowCallback),
+		options(options)
+	{}
+
+	StreamDecoder::~StreamDecoder() = default;
+
+	StreamStatus StreamDecoder::Push(const byte* data, const size_t size) {
+		if (phase == Phase::Done) {
+			return StreamStatus::Done;
+		}
+		StatsScope statsScope(options.stats);
+		buffer.insert(buffer.end(), data, data + size);
+
+		// progressive JPGs go back and forth between markers and scans
+		Phase lastPhase = phase;
+		do {
+			lastPhase = phase;
+			if (phase == Phase::Markers) {
+				ReadMarkers();
+			}
+			else if (phase == Phase::Scan) {
+				FinishScan();
+			}
+		} while (phase != lastPhase && (phase == Phase::Markers || phase == Phase::Scan));
+
+		if (phase == Phase::Rows) {
+			DecodeRows();
+		}
+		else if (phase == Phase::Tail) {
+			// the entropy coded data cannot hold 0xFFD9, so the first one is the EOI marker
+			for (; parsed + 1 < buffer.size(); parsed++) {
+				if (buffer[parsed] == 0xFF && buffer[parsed + 1] == EOI) {
+					Finish(parsed + 2);
+					break;
+				}
+			}
+		}
+		return phase == Phase::Done ? StreamStatus::Done : StreamStatus::NeedMoreData;
+	}
+
+	const JPGFile* StreamDecoder::File() const {
+		return phase == Phase::Markers && contents.huffmanBitstream.data == nullptr ? nullptr : &contents;
+	}
+
+	void StreamDecoder::Reset() {
+		ClearJPGFile(contents);
+		buffer.clear();
+		rows.reset();
+		phase = Phase::Markers;
+		parsed = 0;
+		dataStart = 0;
+	}
+
+	// reads the marker segments that are complete, up to the first scan of a baseline JPG or the end of a progressive
+	// scan (the markers between the scans of progressive JPGs are read the same way)
+	void StreamDecoder::ReadMarkers() {
+		while (phase == Phase::Markers) {
+			if (buffer.size() - parsed < 2) {
+				return;
+			}
+			const byte markerFF = buffer[parsed];
+			const byte markerID = buffer[parsed + 1];
+			if (parsed == 0 && (markerFF != 0xFF || markerID != SOI)) {
+				throw std::invalid_argument("Error - Invalid JPG file (markerFF is not FF or markerID is not SOI at the beginnning)");
+			}
+			if (markerFF != 0xFF) {
+				throw std::invalid_argument("Error - Invalid JPG file (markerFF is not 0xFF)");
+			}
+
+			// fill bytes and the markers without a segment
+			if (markerID == 0xFF) {
+				parsed++;
+				continue;
+			}
+			if (markerID == SOI || markerID == TEM || (markerID >= RST0 && markerID <= RST7)) {
+				parsed += 2;
+				continue;
+			}
+			if (markerID == EOI) {
+				if (contents.sofType != SOF2) {
+					throw std::invalid_argument("Error - Invalid JPG File (EOI marker in front of the first scan)");
+				}
+				if (contents.scans.empty()) {
+					throw std::invalid_argument("Error - Invalid JPG File (File ended before the first scan was complete)");
+				}
+				Finish(parsed + 2);
+				return;
+			}
+
+			// the other markers are only read once their whole segment is there
+			if (buffer.size() - parsed < 4) {
+				return;
+			}
+			const size_t length = (size_t(buffer[parsed + 2]) << 8) | buffer[parsed + 3];
+			if (buffer.size() - parsed - 2 < length) {
+				return;
+			}
+			ByteReader reader(buffer.data() + parsed + 2, length);
+			if (markerID == SOS) {
+				JPGDecoder::ProccesStartOfScan(reader, contents);
+			}
+			else {
+				JPGDecoder::ProcessSegment(markerID, reader, contents);
+			}
+			if (!reader) {
+				throw std::length_error("Error - Invalid JPG (marker segment is longer than its length)");
+			}
+			parsed += 2 + length;
+			if (markerID == SOS) {
+				StartScan();
+			}
+		}
+	}
+
+	void StreamDecoder::StartScan() {
+		if (contents.sofType == SOF2) {
+			if (contents.huffmanBitstream.data == nullptr) {
+				dataStart = parsed;
+				JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+			}
+			contents.huffmanBitstream = { buffer.data() + dataStart, buffer.size() - dataStart };
+			contents.scans.back().offset = parsed - dataStart;
+			phase = Phase::Scan;
+			return;
+		}
+
+		JPGDecoder::CheckComponents(contents);
+		JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		if (options.pipeline != Pipeline::Fused || options.idctMethod != IDCTMethod::Integer) {
+			phase = Phase::Tail;
+			return;
+		}
+
+		// only the MCU rows under the crop are transformed
+		if (memory.arenas.empty()) {
+			memory.arenas.resize(1);
+		}
+		memory.arenas[0].Reset();
+		RowConverter converter(contents, options.upsampling, options.scale, memory.arenas[0]);
+		uint firstRow = 0;
+		uint endRow = 0;
+		MCURange(contents.outputY, contents.outputHeight, 8 / options.scale * contents.maxVSF, contents.mcuHeight, converter.usesNeighbourRows(), firstRow, endRow);
+
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.callback = &rowCallback;
+		rows = std::make_unique<StreamRows>(output, contents, options, firstRow, endRow, memory.arenas[0]);
+		const size_t mcuRowBlocks[3] = { 0 };
+		JPGDecoder::PrepareMCUScan(contents, rows->coefficients, rows->lastCoefficients, mcuRowBlocks, rows->scan);
+
+		// from here on buffer only keeps the entropy coded data that has not been decoded
+		buffer.erase(buffer.begin(), buffer.begin() + parsed);
+		parsed = 0;
+		phase = Phase::Rows;
+	}
+
+	// Huffman decodes the MCU rows whose data is complete and transforms them. A row that runs into the end of the
+	// data is decoded again from the start once more of it is there.
+	void StreamDecoder::DecodeRows() {
+		StreamRows& state = *rows;
+		// a 0xFF at the end could be a stuffed byte or start a marker, the reader only gets it with the byte after it
+		size_t available = buffer.size();
+		while (available != 0 && buffer[available - 1] == 0xFF) {
+			available--;
+		}
+		state.reader.resume(buffer.data(), available);
+
+		StageTimer timer;
+		const uint mcuWidth = contents.mcuWidth;
+		while (state.nextRow < state.endRow) {
+			const uint y = state.nextRow;
+			const BitReader start = state.reader;
+			const int prevCoeff[3] = { state.prevCoeff[0], state.prevCoeff[1], state.prevCoeff[2] };
+			bool complete = false;
+			try {
+				state.scan.decode(state.reader, state.scan, y * mcuWidth, (y + 1) * mcuWidth, 0, state.prevCoeff);
+				complete = state.reader.complete();
+			}
+			catch (const std::exception&) {
+				// invalid codes may just be the end of the data so far, the row is decoded again with more of it
+				if (!state.reader.pastEnd()) {
+					throw;
+				}
+			}
+			if (!complete) {
+				state.reader = start;
+				std::copy(prevCoeff, prevCoeff + 3, state.prevCoeff);
+				break;
+			}
+			timer.lap(&StageTimes::huffman);
+
+			state.nextRow++;
+			if (y >= state.firstRow) {
+				state.rows.transform(y, state.coefficients, state.lastCoefficients, timer);
+			}
+		}
+
+		buffer.erase(buffer.begin(), buffer.begin() + state.reader.offset(buffer.data()));
+		if (state.nextRow == state.endRow) {
+			rows.reset();
+			phase = Phase::Done;
+		}
+	}
+
+	// decodes the progressive scan that started at parsed once it is complete and goes back to reading markers
+	void StreamDecoder::FinishScan() {
+		contents.huffmanBitstream = { buffer.data() + dataStart, buffer.size() - dataStart };
+		Scan& scan = contents.scans.back();
+		const size_t scanEnd = ScanEnd(contents.huffmanBitstream, parsed - dataStart);
+		if (scanEnd >= contents.huffmanBitstream.size) {
+			// the search continues at the last byte, which may be the 0xFF of a marker
+			parsed = std::max(dataStart + scan.offset, buffer.size() - 1);
+			return;
+		}
+		scan.length = scanEnd - scan.offset;
+		parsed = dataStart + scanEnd;
+		JPGDecoder::DecodeScans(contents, options.numScans);
+		phase = Phase::Markers;
+	}
+
+	// decodes the rows of a file that ends at end, what is in buffer
+	void StreamDecoder::Finish(const size_t end) {
+		if (contents.sofType == SOF2) {
+			contents.huffmanBitstream = { buffer.data() + dataStart, buffer.size() - dataStart };
+			JPGDecoder::CheckComponents(contents);
+		}
+		else {
+			JPGDecoder::ReadJPG(buffer.data(), end, contents);
+			JPGDecoder::SetOutputSize(contents, options.scale, options.crop);
+		}
+		OutputRows output;
+		output.format = options.pixelFormat;
+		output.callback = &rowCallback;
+		JPGDecoder::Decode(contents, output, options, memory);
+		phase = Phase::Done;
+	}
 }
\ No newline at end of file
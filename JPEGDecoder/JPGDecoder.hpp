@@ -2,7 +2,16 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <new>
 #include <fstream>
+#include <cstdint>
+#include <functional>
+#include <algorithm>
+
+// 1 = the decoder counts what it does into DecodeOptions::stats, 0 = the counters are compiled out
+#ifndef JPG_STATS
+#define JPG_STATS 0
+#endif
 
 namespace JPG {
 	using byte = unsigned char;
@@ -101,6 +110,12 @@ namespace JPG {
 		53, 60, 61, 54, 47, 55, 62, 63
 	};
 
+	// bytes that belong to someone else
+	struct ByteSpan {
+		const byte* data = nullptr;
+		size_t size = 0;
+	};
+
 	struct ColorComponent {
 		byte HSF = 1;
 		byte VSF = 1;
@@ -108,16 +123,27 @@ namespace JPG {
 		byte huffmanDCTableID = 0;
 		byte huffmanACTableID = 0;
 		bool used = false;
+
+		uint width = 0; // samples per row (image width scaled by HSF / largest HSF)
+		uint height = 0;
+		uint blockWidth = 0; // blocks per row including the padding to whole MCUs (mcuWidth * HSF)
+		uint blockHeight = 0;
 	};
 
 	struct QuantizationTable {
-		uint table[64];
+		uint16_t table[64];
 		bool set = false;
 	};
 
+	// Huffman codes up to this length are resolved with a single table load
+	const uint HuffmanLookupBits = 9;
+
 	struct HuffmanTable {
-		std::vector<std::vector<byte>> symbols = std::vector<std::vector<byte>>(16);
-		std::vector<std::vector<uint>> codes = std::vector<std::vector<uint>>(16);
+		byte offsets[17] = { 0 }; // symbols of length i + 1 are symbols[offsets[i]] to symbols[offsets[i + 1] - 1]
+		byte symbols[162] = { 0 };
+		int maxCode[16] = { 0 }; // largest code of length i + 1 (-1 if there are none)
+		int valueOffset[16] = { 0 }; // symbols index of a code of length i + 1 is code + valueOffset[i]
+		uint16_t lookup[1 << HuffmanLookupBits] = { 0 }; // (code length << 8) | symbol, 0 if the code is longer than HuffmanLookupBits
 		bool set = false;
 	};
 
@@ -140,6 +166,114 @@ namespace JPG {
 		}
 	};
 
+	// allocator for std::vector that aligns the elements for SIMD loads and to cache lines (the default allocator only
+	// aligns to alignof(T))
+	template<typename T, size_t Alignment = 64>
+	struct AlignedAllocator {
+		using value_type = T;
+		template<typename U>
+		struct rebind {
+			using other = AlignedAllocator<U, Alignment>;
+		};
+
+		AlignedAllocator() = default;
+		template<typename U>
+		AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+		T* allocate(const size_t n) {
+			return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+		}
+
+		void deallocate(T* data, const size_t) {
+			::operator delete(data, std::align_val_t(Alignment));
+		}
+
+		template<typename U>
+		bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+		template<typename U>
+		bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+	};
+
+	template<typename T>
+	using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+	// Hands out scratch memory for one decode from large blocks. Reset makes all of it free again and merges the
+	// blocks into one, so the next decode of an image of the same size does not allocate.
+	class Arena {
+	public:
+		// n uninitialized elements of a trivial type, 64 byte aligned
+		template<typename T>
+		T* Allocate(const size_t n) {
+			const size_t size = (n * sizeof(T) + 63) & ~size_t(63);
+			if (blocks.empty() || blocks.back().size() - used < size) {
+				blocks.emplace_back(std::max(size, blocks.empty() ? size_t(64 * 1024) : blocks.back().size() * 2));
+				used = 0;
+			}
+			T* memory = reinterpret_cast<T*>(blocks.back().data() + used);
+			used += size;
+			return memory;
+		}
+
+		void Reset() {
+			if (blocks.size() > 1) {
+				size_t total = 0;
+				for (const AlignedVector<byte>& block : blocks) {
+					total += block.size();
+				}
+				blocks.clear();
+				blocks.emplace_back(total);
+			}
+			used = 0;
+		}
+	private:
+		std::vector<AlignedVector<byte>> blocks;
+		size_t used = 0; // bytes of the last block that are handed out
+	};
+
+	// one color component of the whole image, for the multi pass pipeline and the scans of progressive JPGs
+	struct ComponentPlane {
+		AlignedVector<int16_t> coefficients; // blockWidth x blockHeight blocks of 64 coefficients (not dequantized), row by row
+		AlignedVector<byte> lastCoefficients; // zigzag index of the last non-zero coefficient of each block (baseline only)
+		AlignedVector<byte> samples; // blockWidth x blockHeight blocks of 8x8 samples (fewer when decoding at a reduced scale)
+	};
+
+	// one scan of a progressive JPG
+	struct Scan {
+		byte numComponents = 0;
+		byte components[3] = { 0 }; // indices into JPGFile::components
+		HuffmanTable huffmanTables[3]; // table of each component (DC tables for DC scans, AC tables for AC scans)
+
+		byte startOfSelection = 0;
+		byte endOfSelection = 0;
+		byte successiveApproximationHigh = 0;
+		byte successiveApproximationLow = 0;
+
+		uint restartInterval = 0;
+		size_t offset = 0; // entropy coded data of the scan in JPGFile::huffmanBitstream
+		size_t length = 0;
+	};
+
+	// what ProbeJPG finds in the markers in front of the first scan
+	struct JPGInfo {
+		struct Component {
+			byte id = 0;
+			byte HSF = 1;
+			byte VSF = 1;
+			byte quantizationTableID = 0;
+		};
+
+		byte sofType = 0; // the SOF marker (SOF0 - SOF15)
+		byte precision = 0; // bits per sample
+		uint width = 0;
+		uint height = 0;
+		byte numComponents = 0;
+		Component components[4]; // in the order of the SOF marker
+		uint restartInterval = 0; // of the first scan
+		// ReadJPG can decode its frame: 8 bit baseline or progressive with 1 or 3 components whose IDs, sampling
+		// factors and blocks per MCU ReadJPG supports (the tables and scans are not checked)
+		bool supported = false;
+	};
+
 	struct JPGFile {
 		QuantizationTable qtTables[4] = { 0 };
 		HuffmanTable huffmanDCTables[4];
@@ -153,42 +287,255 @@ namespace JPG {
 		uint mcuHeight = 0;
 		byte numComponents = 0;
 
+		byte maxHSF = 1; // largest sampling factors, an MCU covers 8 * maxHSF x 8 * maxVSF pixels
+		byte maxVSF = 1;
+		uint blockWidth = 0; // size of the image in 8x8 pixel blocks including the padding to whole MCUs
+		uint blockHeight = 0;
+
+		// size of the image that DecodeJPG returned, smaller than width x height when decoding at a reduced scale or
+		// a crop. Its MCU array has outputBlockWidth x outputBlockHeight blocks of 8x8 pixels.
+		uint outputWidth = 0;
+		uint outputHeight = 0;
+		uint outputBlockWidth = 0;
+		uint outputBlockHeight = 0;
+		uint outputX = 0; // top left corner of the crop in the scaled image
+		uint outputY = 0;
+
 		byte startOfSelection = 0;
 		byte endOfSelection = 0;
 		byte successiveApproximationHigh = 0;
 		byte successiveApproximationLow = 0;
 
-		std::vector<byte> huffmanBitstream;
+		std::shared_ptr<const byte> fileData; // the file if ReadJPG opened it (memory mapped on Linux), empty for caller owned memory
+		ByteSpan huffmanBitstream; // entropy coded data as stored in the file (still byte stuffed, RST markers included)
 
 		uint restartInterval = 0;
+		std::vector<size_t> restartOffsets; // where each restart interval starts in huffmanBitstream
+
+		// progressive JPGs: huffmanBitstream is everything after the first SOS marker and each scan knows its part of it
+		std::vector<Scan> scans;
+		uint scansDecoded = 0;
+		ComponentPlane planes[3]; // coefficients refined by every decoded scan
+		bool truncated = false; // the file ended before the EOI marker, only the complete scans are kept
 
 		bool zerobased = false;
 	};
 
+	enum class IDCTMethod {
+		Integer, // separable fixed point IDCT
+		Reference // direct float evaluation of the IDCT formula (very slow, for checking the other methods)
+	};
+
+	enum class Pipeline {
+		Fused, // takes one MCU row at a time through all decoding stages while it is still in the cache
+		MultiPass // runs every stage over the whole image before starting the next one
+	};
+
+	enum class Upsampling {
+		Nearest, // repeats each chroma sample (box filter)
+		Fancy // triangle filter between neighbouring chroma samples, same results as libjpeg
+	};
+
+	// interleaved 8 bit pixels, Gray8 of a color JPG is its Y component
+	enum class PixelFormat {
+		RGB8,
+		BGR8,
+		RGBA8, // alpha is always 255
+		Gray8
+	};
+
+	// seconds spent in the stages of a decode
+	struct StageTimes {
+		double huffman = 0; // entropy decoding (all scans of progressive JPGs)
+		double idct = 0; // dequantization and IDCT
+		double color = 0; // upsampling and color conversion
+	};
+
+	// What a decode did, to tell which images are expensive and why. The counters sit in the hot loops, so they are
+	// only collected when the library is built with JPG_STATS 1 (the struct stays all zero otherwise).
+	struct DecodeStats {
+		StageTimes times; // summed over the threads that worked on a stage
+		uint64_t entropyBytes = 0; // entropy coded bytes read, including stuffed bytes
+		uint64_t entropyBits = 0; // bits of huffman codes and coefficients
+		uint64_t symbols = 0; // huffman symbols decoded
+		uint64_t restarts = 0; // restart markers passed or jumped to
+		uint64_t blocks = 0; // blocks decoded by baseline scans
+		uint64_t blocksByLastCoefficient[64] = { 0 }; // baseline blocks by the zigzag index of their last nonzero coefficient (0 = only DC)
+		uint64_t zeroRuns[17] = { 0 }; // baseline AC coefficients by the run of zeros in front of them, 16 counts ZRL symbols
+	};
+
+	// rectangle in pixels
+	struct Rect {
+		uint x = 0;
+		uint y = 0;
+		uint width = 0; // 0 = up to the right edge
+		uint height = 0; // 0 = down to the bottom
+	};
+
+	struct DecodeOptions {
+		IDCTMethod idctMethod = IDCTMethod::Integer;
+		Pipeline pipeline = Pipeline::Fused; // the reference IDCT always uses the multi pass pipeline
+		Upsampling upsampling = Upsampling::Fancy; // for components with smaller sampling factors
+		PixelFormat pixelFormat = PixelFormat::RGB8; // of the rows given to DecodeJPGRows and of the buffer DecodeJPG writes into
+		uint scale = 1; // decode at 1 / scale of the size (1, 2, 4 or 8) with smaller IDCTs, much faster for thumbnails
+		// decode only this part of the (scaled) image. The fused pipeline skips the IDCT and color conversion of MCUs
+		// outside of it, and the huffman decoding of restart intervals in front of the MCUs it needs.
+		Rect crop;
+		uint numScans = 0; // progressive JPGs: render after this many scans (0 = all), later calls continue from the scans decoded so far
+		// threads for decoding bands of MCU rows in parallel, 0 = all hardware threads. JPGs without restart markers are
+		// huffman decoded on one of them while the others transform the rows it has finished. Decodes on different
+		// threads run at the same time and share the threads of ThreadPool::Default().
+		uint numThreads = 0;
+		DecodeStats* stats = nullptr; // the decode adds its statistics to it (needs JPG_STATS)
+	};
+
+	// gets each finished row of outputWidth pixels (in DecodeOptions::pixelFormat) from top to bottom, the row
+	// buffer is reused for the next row
+	using RowCallback = std::function<void(uint row, const byte* pixels)>;
+
+	// memory a decode works in besides the JPGFile, Decoder keeps it for the next image
+	struct DecodeMemory {
+		std::vector<Arena> arenas; // scratch rows of each band of MCU rows that is decoded on its own
+		// whole image planes of the multi pass pipeline and the coefficients of a huffman decoding thread (progressive JPGs use JPGFile::planes)
+		ComponentPlane planes[3];
+	};
+
 	class JPGDecoder {
 	public:
 		static std::unique_ptr<JPGFile> ReadJPG(const std::string& filename);
-		static std::unique_ptr<MCU[]> DecodeJPG(JPGFile& contents);
+		// reads a JPG that is already in memory without copying it, the data has to outlive the returned JPGFile
+		static std::unique_ptr<JPGFile> ReadJPG(const byte* data, const size_t size);
+		// reads only the markers in front of the first scan (usually the first few KB, the file is read through a
+		// small buffer and seeks over APP segments), without checking the tables
+		static JPGInfo ProbeJPG(const std::string& filename);
+		static JPGInfo ProbeJPG(const byte* data, const size_t size);
+		static std::unique_ptr<MCU[]> DecodeJPG(JPGFile& contents, const DecodeOptions& options = DecodeOptions());
+		// writes the image into a buffer of outputHeight rows that are stride bytes apart, each holding outputWidth
+		// pixels in options.pixelFormat
+		static void DecodeJPG(JPGFile& contents, byte* pixels, const size_t stride, const DecodeOptions& options = DecodeOptions());
+		// streams the image row by row without an output array. With the fused pipeline and the integer IDCT only a
+		// few MCU rows are kept in memory (and the coefficients of progressive JPGs), rows are decoded on this thread.
+		static void DecodeJPGRows(JPGFile& contents, const RowCallback& rowCallback, const DecodeOptions& options = DecodeOptions());
 		static void WriteBMPFromJPG(const JPGFile& contents, const MCU mcus[], const std::string& fileName);
+		// decodes like DecodeJPG with the multi pass pipeline and adds the time of every stage to times, for benchmarks.
+		// Progressive JPGs decode all of their scans again.
+		static void DecodeStages(JPGFile& contents, byte* pixels, const size_t stride, const DecodeOptions& options, StageTimes& times);
+
+		// sets outputWidth and outputHeight for decoding crop at 1 / scale of the size, to size the buffer before DecodeJPG
+		static void SetOutputSize(JPGFile& contents, const uint scale, const Rect& crop = Rect());
+		static uint BytesPerPixel(const PixelFormat format);
 	private:
-		static void ProcessAPPN(std::ifstream& file, JPGFile& jpgContents);
-		static void ProcessQuantizationTable(std::ifstream& file, JPGFile& jpgContents);
-		static void ProcessHuffmanTable(std::ifstream& file, JPGFile& jpgContents);
-		static void ProcessStartOfFrame(std::ifstream& file, JPGFile& jpgContents);
-		static void ProcessRestartInterval(std::ifstream& file, JPGFile& jpgContents);
-		static void ProccesStartOfScan(std::ifstream& file, JPGFile& jpgContents);
-		static void ProcessComment(std::ifstream& file, JPGFile& jpgContents);
+		friend class Decoder;
+		friend class StreamDecoder;
+		// reads the headers into contents, keeping the memory of the vectors it already has
+		static void ReadJPG(const byte* data, const size_t size, JPGFile& contents);
+		static void ProcessAPPN(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProcessQuantizationTable(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProcessHuffmanTable(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProcessStartOfFrame(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProcessRestartInterval(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProccesStartOfScan(class ByteReader& reader, JPGFile& jpgContents);
+		static void ProcessComment(class ByteReader& reader, JPGFile& jpgContents);
+		// reads the segment of a table, frame or APP / COM marker, false for any other marker (its segment is not read)
+		static bool ProcessSegment(const byte markerID, class ByteReader& reader, JPGFile& jpgContents);
+		// throws if the components are not supported or use tables that were not defined
+		static void CheckComponents(const JPGFile& jpgContents);
 	private:
-		static void DecodeHuffmanData(MCU mcus[], JPGFile& contents);
-		static void DequantizeMCUs(MCU mcus[], JPGFile& contents);
-		static void InverseDiscreteCosineTransform(MCU mcus[], JPGFile& contents);
-		static void YCbCrToRGB(MCU mcus[], JPGFile& contents);
+		static void Decode(JPGFile& contents, const struct OutputRows& output, const DecodeOptions& options, DecodeMemory& memory, StageTimes* times = nullptr);
+		static bool HasRestartOffsets(const JPGFile& contents);
+		static void DecodeScans(JPGFile& contents, const uint numScans);
+		static void DecodeProgressiveScan(JPGFile& contents, const Scan& scan);
+		static void DecodeFused(const struct OutputRows& output, JPGFile& contents, const DecodeOptions& options, DecodeMemory& memory);
+		static void DecodeFusedRows(const struct OutputRows& output, JPGFile& contents, class BitReader& b, const uint bitstreamMCU, const uint firstRow, const uint endRow, const DecodeOptions& options, Arena& arena, struct BandEdgeRows& edges, const class CoefficientRows* coefficientRows);
+		static void DecodeHuffmanData(ComponentPlane planes[], JPGFile& contents, const uint numThreads);
+		static void DecodeHuffmanMCUs(ComponentPlane planes[], JPGFile& contents, class BitReader& b, const uint firstMCU, const uint endMCU);
+		static void InverseDiscreteCosineTransform(ComponentPlane planes[], JPGFile& contents, const IDCTMethod method, const uint scale);
+		static void DequantizeIDCT(ComponentPlane planes[], JPGFile& contents, const uint scale);
+		static void YCbCrToRGB(const ComponentPlane planes[], JPGFile& contents, const struct OutputRows& output, const Upsampling upsampling, const uint scale, Arena& arena);
 		static void GenerateHuffmanCodes(HuffmanTable& hTable);
-		static void DecodeMCUComponent(class BitReader& b, HuffmanTable& huffmanDCTable, HuffmanTable& huffmanACTable, int MCUComponent[64], int& prevCoeff);
+		static void PrepareMCUScan(const JPGFile& contents, int16_t* const coefficients[3], byte* const lastCoefficients[3], const size_t mcuRowBlocks[3], struct MCUScan& scan);
+		template<uint numComponents, uint lumaHSF, uint lumaVSF, bool restarts>
+		static void DecodeMCUs(class BitReader& b, const struct MCUScan& scan, const uint firstMCU, const uint endMCU, const uint resumeMCU, int prevCoeff[3]);
+		// returns the zigzag index of the last non-zero coefficient
+		static byte DecodeMCUComponent(class BitReader& b, const HuffmanTable& huffmanDCTable, const HuffmanTable& huffmanACTable, int16_t MCUComponent[64], int& prevCoeff);
+	};
+
+	// Decodes one JPG after another and keeps everything it allocated (the JPGFile with its tables and coefficient
+	// planes, the file, scratch rows and pixels) for the next one. Once it has seen an image of the largest size,
+	// reading from memory and decoding do not allocate any more.
+	class Decoder {
+	public:
+		explicit Decoder(const DecodeOptions& options = DecodeOptions()) : options(options) {}
+
+		// reads the headers of a JPG in memory and sets its output size for options.scale, the data has to stay valid
+		// while the image is decoded
+		const JPGFile& Read(const byte* data, const size_t size);
+		// reads the file into the decoder's file buffer
+		const JPGFile& Read(const std::string& fileName);
+
+		// decodes into the decoder's pixel buffer of outputHeight rows of outputWidth pixels, valid until the next Decode
+		const byte* Decode();
+		void Decode(byte* pixels, const size_t stride);
+		void DecodeRows(const RowCallback& rowCallback);
+
+		const JPGFile& File() const { return contents; }
+
+		DecodeOptions options;
+	private:
+		JPGFile contents;
+		DecodeMemory memory;
+		std::vector<byte> fileBuffer;
+		std::vector<byte> pixels;
+	};
+
+	enum class StreamStatus {
+		NeedMoreData, // everything the data so far allows is decoded
+		Done // the last row has been passed on, the rest of the data is ignored
+	};
+
+	// Decodes a JPG while it arrives, for data that comes in over a slow connection. Push takes the data in chunks of
+	// any size, reads the markers as soon as their segments are complete and passes every row to the callback (from top
+	// to bottom, in options.pixelFormat) as soon as the entropy coded data of its MCU rows is there. Baseline JPGs are
+	// decoded one MCU row at a time with the fused pipeline and only keep the data they have not decoded yet. Progressive
+	// JPGs decode each scan once it is complete and pass on all rows at the EOI marker, so do baseline JPGs that are
+	// decoded with the multi pass pipeline or the reference IDCT.
+	class StreamDecoder {
+	public:
+		explicit StreamDecoder(const RowCallback& rowCallback, const DecodeOptions& options = DecodeOptions());
+		~StreamDecoder();
+
+		// copies the next size bytes of the JPG and decodes whatever they complete, throws for invalid JPGs
+		StreamStatus Push(const byte* data, const size_t size);
+		// the headers once the first scan starts (nullptr before), with the output size of options.scale and options.crop
+		const JPGFile* File() const;
+		// starts over with the next JPG, keeping the memory
+		void Reset();
+	private:
+		void ReadMarkers();
+		void StartScan();
+		void DecodeRows();
+		void FinishScan();
+		void Finish(const size_t end);
+	private:
+		enum class Phase {
+			Markers, // reading the marker segments
+			Rows, // huffman decoding the scan of a baseline JPG
+			Scan, // waiting for the end of a progressive scan
+			Tail, // waiting for the EOI marker to decode the whole file
+			Done
+		};
+
+		RowCallback rowCallback;
+		DecodeOptions options;
+		Phase phase = Phase::Markers;
+		JPGFile contents;
+		DecodeMemory memory;
+		std::vector<byte> buffer; // the data that is still needed
+		size_t parsed = 0; // bytes of buffer that have been read
+		size_t dataStart = 0; // progressive JPGs: the first entropy coded byte in buffer
+		std::unique_ptr<struct StreamRows> rows; // state of the baseline scan
 	};
 }
 
 // TODO :
-// Add support for restart intervals in HCB
 // Add error handling for invalid markers
-// Add optimized IDCT
\ No newline at end of file
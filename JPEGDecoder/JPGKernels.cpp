@@ -0,0 +1,461 @@
+#include "JPGKernels.hpp"
+#include <algorithm>
+
+#if JPG_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace JPG {
+
+
+
+	// --- Scalar Kernels --- \\
+
+
+
+	inline int Descale(const int x, const int n) {
+		return (x + (1 << (n - 1))) >> n;
+	}
+
+	// 1D 8 point IDCT on in[0], in[stride], ... in[7 * stride]. Outputs are scaled up by 2^IDCTConstBits
+	// except for the even part which has to be scaled by the caller.
+	struct IDCT1D {
+		int tmp10, tmp11, tmp12, tmp13;
+		int tmp0, tmp1, tmp2, tmp3;
+
+		IDCT1D(const int* in, const uint stride) {
+			// even part
+			int z2 = in[2 * stride];
+			int z3 = in[6 * stride];
+			int z1 = (z2 + z3) * FIX_0_541196100;
+			tmp2 = z1 + z3 * (-FIX_1_847759065);
+			tmp3 = z1 + z2 * FIX_0_765366865;
+
+			z2 = in[0];
+			z3 = in[4 * stride];
+			tmp0 = (z2 + z3) * (1 << IDCTConstBits);
+			tmp1 = (z2 - z3) * (1 << IDCTConstBits);
+
+			tmp10 = tmp0 + tmp3;
+			tmp13 = tmp0 - tmp3;
+			tmp11 = tmp1 + tmp2;
+			tmp12 = tmp1 - tmp2;
+
+			// odd part
+			tmp0 = in[7 * stride];
+			tmp1 = in[5 * stride];
+			tmp2 = in[3 * stride];
+			tmp3 = in[1 * stride];
+
+			z1 = tmp0 + tmp3;
+			z2 = tmp1 + tmp2;
+			z3 = tmp0 + tmp2;
+			int z4 = tmp1 + tmp3;
+			const int z5 = (z3 + z4) * FIX_1_175875602;
+
+			tmp0 *= FIX_0_298631336;
+			tmp1 *= FIX_2_053119869;
+			tmp2 *= FIX_3_072711026;
+			tmp3 *= FIX_1_501321110;
+			z1 *= -FIX_0_899976223;
+			z2 *= -FIX_2_562915447;
+			z3 *= -FIX_1_961570560;
+			z4 *= -FIX_0_390180644;
+
+			z3 += z5;
+			z4 += z5;
+
+			tmp0 += z1 + z3;
+			tmp1 += z2 + z4;
+			tmp2 += z2 + z3;
+			tmp3 += z1 + z4;
+		}
+
+		void store(int* out, const uint stride, const int shift) const {
+			out[0 * stride] = Descale(tmp10 + tmp3, shift);
+			out[7 * stride] = Descale(tmp10 - tmp3, shift);
+			out[1 * stride] = Descale(tmp11 + tmp2, shift);
+			out[6 * stride] = Descale(tmp11 - tmp2, shift);
+			out[2 * stride] = Descale(tmp12 + tmp1, shift);
+			out[5 * stride] = Descale(tmp12 - tmp1, shift);
+			out[3 * stride] = Descale(tmp13 + tmp0, shift);
+			out[4 * stride] = Descale(tmp13 - tmp0, shift);
+		}
+	};
+
+	// separable fixed point IDCT: columns first into a workspace with IDCTPass1Bits extra bits of precision, then rows
+	void IntegerIDCTBlock(int block[64]) {
+		int workspace[64];
+		for (uint x = 0; x < 8; x++) {
+			const int* column = block + x;
+			// a column without AC coefficients is just its scaled DC value
+			if ((column[8] | column[16] | column[24] | column[32] | column[40] | column[48] | column[56]) == 0) {
+				const int dc = column[0] * (1 << IDCTPass1Bits);
+				for (uint y = 0; y < 8; y++) {
+					workspace[y * 8 + x] = dc;
+				}
+				continue;
+			}
+			IDCT1D(column, 8).store(workspace + x, 8, IDCTConstBits - IDCTPass1Bits);
+		}
+		for (uint y = 0; y < 8; y++) {
+			const int* row = workspace + y * 8;
+			if ((row[1] | row[2] | row[3] | row[4] | row[5] | row[6] | row[7]) == 0) {
+				const int dc = Descale(row[0], IDCTPass1Bits + 3);
+				for (uint x = 0; x < 8; x++) {
+					block[y * 8 + x] = dc;
+				}
+				continue;
+			}
+			IDCT1D(row, 1).store(block + y * 8, 1, IDCTConstBits + IDCTPass1Bits + 3);
+		}
+	}
+
+
+	void DequantizeIDCTScalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		for (uint i = 0; i < numBlocks; i++, coefficients += 64, output += 8) {
+			if (lastCoefficients && lastCoefficients[i] == 0) {
+				StoreDCBlock(coefficients[0], quantizationTable[0], output, stride, 8);
+				continue;
+			}
+			int block[64];
+			for (uint k = 0; k < 64; k++) {
+				block[k] = int16_t(coefficients[k] * quantizationTable[k]);
+			}
+			IntegerIDCTBlock(block);
+			for (uint y = 0; y < 8; y++) {
+				for (uint x = 0; x < 8; x++) {
+					output[y * stride + x] = byte(std::min(std::max(block[y * 8 + x] + 128, 0), 255));
+				}
+			}
+		}
+	}
+	inline byte ClampSample(const int x) {
+		return byte(std::min(std::max(x + 128, 0), 255));
+	}
+
+	void StoreDCBlock(const int16_t coefficient, const uint16_t quantization, byte* output, const size_t stride, const uint blockSize) {
+		const byte sample = DCSample(coefficient, quantization);
+		for (uint y = 0; y < blockSize; y++) {
+			std::fill(output + y * stride, output + y * stride + blockSize, sample);
+		}
+	}
+
+	// 4 point IDCT from the 8 point inputs in[0], in[stride], ... in[7 * stride] (in[4 * stride] does not contribute).
+	// Outputs are scaled up by 2^(IDCTConstBits + 1).
+	struct IDCT4Point {
+		int tmp10, tmp12;
+		int tmp0, tmp2;
+
+		IDCT4Point(const int* in, const uint stride) {
+			const int dc = in[0] * (1 << (IDCTConstBits + 1));
+			const int even = in[2 * stride] * FIX_1_847759065 - in[6 * stride] * FIX_0_765366865;
+			tmp10 = dc + even;
+			tmp12 = dc - even;
+
+			const int z1 = in[7 * stride];
+			const int z2 = in[5 * stride];
+			const int z3 = in[3 * stride];
+			const int z4 = in[1 * stride];
+			tmp0 = -z1 * FIX_0_211164243 + z2 * FIX_1_451774981 - z3 * FIX_2_172734803 + z4 * FIX_1_061594337;
+			tmp2 = -z1 * FIX_0_509795579 - z2 * FIX_0_601344887 + z3 * FIX_0_899976223 + z4 * FIX_2_562915447;
+		}
+
+		int operator[](const uint i) const {
+			switch (i) {
+			case 0:
+				return tmp10 + tmp2;
+			case 1:
+				return tmp12 + tmp0;
+			case 2:
+				return tmp12 - tmp0;
+			default:
+				return tmp10 - tmp2;
+			}
+		}
+	};
+
+	// 2 point IDCT, only the DC and the odd inputs contribute. Outputs are scaled up by 2^(IDCTConstBits + 2).
+	inline void IDCT2Point(const int* in, const uint stride, int& out0, int& out1) {
+		const int dc = in[0] * (1 << (IDCTConstBits + 2));
+		const int odd = -in[7 * stride] * FIX_0_720959822 + in[5 * stride] * FIX_0_850430095 - in[3 * stride] * FIX_1_272758580 + in[1 * stride] * FIX_3_624509785;
+		out0 = dc + odd;
+		out1 = dc - odd;
+	}
+
+	void DequantizeIDCT4x4Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		for (uint i = 0; i < numBlocks; i++, coefficients += 64, output += 4) {
+			if (lastCoefficients && lastCoefficients[i] == 0) {
+				StoreDCBlock(coefficients[0], quantizationTable[0], output, stride, 4);
+				continue;
+			}
+			int block[64];
+			for (uint k = 0; k < 64; k++) {
+				block[k] = int16_t(coefficients[k] * quantizationTable[k]);
+			}
+
+			// 4 rows of 8 columns, column 4 is not used by the row pass
+			int workspace[32];
+			for (uint x = 0; x < 8; x++) {
+				const int* column = block + x;
+				if (x == 4) {
+					continue;
+				}
+				if ((column[8] | column[16] | column[24] | column[40] | column[48] | column[56]) == 0) {
+					for (uint y = 0; y < 4; y++) {
+						workspace[y * 8 + x] = column[0] * (1 << IDCTPass1Bits);
+					}
+					continue;
+				}
+				const IDCT4Point idct(column, 8);
+				for (uint y = 0; y < 4; y++) {
+					workspace[y * 8 + x] = Descale(idct[y], IDCTConstBits - IDCTPass1Bits + 1);
+				}
+			}
+			for (uint y = 0; y < 4; y++) {
+				const int* row = workspace + y * 8;
+				if ((row[1] | row[2] | row[3] | row[5] | row[6] | row[7]) == 0) {
+					std::fill(output + y * stride, output + y * stride + 4, ClampSample(Descale(row[0], IDCTPass1Bits + 3)));
+					continue;
+				}
+				const IDCT4Point idct(row, 1);
+				for (uint x = 0; x < 4; x++) {
+					output[y * stride + x] = ClampSample(Descale(idct[x], IDCTConstBits + IDCTPass1Bits + 3 + 1));
+				}
+			}
+		}
+	}
+
+	void DequantizeIDCT2x2Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		for (uint i = 0; i < numBlocks; i++, coefficients += 64, output += 2) {
+			if (lastCoefficients && lastCoefficients[i] == 0) {
+				StoreDCBlock(coefficients[0], quantizationTable[0], output, stride, 2);
+				continue;
+			}
+			int block[64];
+			for (uint k = 0; k < 64; k++) {
+				block[k] = int16_t(coefficients[k] * quantizationTable[k]);
+			}
+
+			// the row pass only uses columns 0, 1, 3, 5 and 7
+			int workspace[16] = { 0 };
+			for (const uint x : { 0, 1, 3, 5, 7 }) {
+				const int* column = block + x;
+				if ((column[8] | column[24] | column[40] | column[56]) == 0) {
+					workspace[x] = workspace[8 + x] = column[0] * (1 << IDCTPass1Bits);
+					continue;
+				}
+				int out0, out1;
+				IDCT2Point(column, 8, out0, out1);
+				workspace[x] = Descale(out0, IDCTConstBits - IDCTPass1Bits + 2);
+				workspace[8 + x] = Descale(out1, IDCTConstBits - IDCTPass1Bits + 2);
+			}
+			for (uint y = 0; y < 2; y++) {
+				const int* row = workspace + y * 8;
+				if ((row[1] | row[3] | row[5] | row[7]) == 0) {
+					output[y * stride] = output[y * stride + 1] = ClampSample(Descale(row[0], IDCTPass1Bits + 3));
+					continue;
+				}
+				int out0, out1;
+				IDCT2Point(row, 1, out0, out1);
+				output[y * stride] = ClampSample(Descale(out0, IDCTConstBits + IDCTPass1Bits + 3 + 2));
+				output[y * stride + 1] = ClampSample(Descale(out1, IDCTConstBits + IDCTPass1Bits + 3 + 2));
+			}
+		}
+	}
+
+	// at 1/8 of the size a block is just its average, the DC coefficient
+	void DequantizeIDCT1x1Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		for (uint i = 0; i < numBlocks; i++) {
+			output[i] = DCSample(coefficients[i * 64], quantizationTable[0]);
+		}
+	}
+
+	void UpsampleH2V1Columns(const byte* input, byte* output, const uint first, const uint end, const uint inputWidth) {
+		for (uint i = first; i < end; i++) {
+			const int sample = input[i] * 3;
+			// the outermost samples of a row have no neighbour to blend with
+			output[2 * i] = i == 0 ? input[0] : byte((sample + input[i - 1] + 1) >> 2);
+			output[2 * i + 1] = i == inputWidth - 1 ? input[i] : byte((sample + input[i + 1] + 2) >> 2);
+		}
+	}
+
+	void UpsampleH2V2Columns(const byte* nearRow, const byte* farRow, byte* output, const uint first, const uint end, const uint inputWidth) {
+		auto columnSum = [nearRow, farRow](const uint i) {
+			return nearRow[i] * 3 + farRow[i];
+		};
+		for (uint i = first; i < end; i++) {
+			const int sum = columnSum(i) * 3;
+			output[2 * i] = byte((i == 0 ? sum + columnSum(0) + 8 : sum + columnSum(i - 1) + 8) >> 4);
+			output[2 * i + 1] = byte((i == inputWidth - 1 ? sum + columnSum(i) + 7 : sum + columnSum(i + 1) + 7) >> 4);
+		}
+	}
+
+	void UpsampleH2V1Scalar(const byte* input, byte* output, uint inputWidth) {
+		UpsampleH2V1Columns(input, output, 0, inputWidth, inputWidth);
+	}
+
+	void UpsampleH2V2Scalar(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth) {
+		UpsampleH2V2Columns(nearRow, farRow, output, 0, inputWidth, inputWidth);
+	}
+
+	void UpsampleH1V2Scalar(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow) {
+		const int bias = farIsBelow ? 2 : 1;
+		for (uint i = 0; i < width; i++) {
+			output[i] = byte((nearRow[i] * 3 + farRow[i] + bias) >> 2);
+		}
+	}
+
+	template<uint red, uint green, uint blue, uint bytesPerPixel>
+	static void YCbCrToPixels(const byte* y, const byte* cb, const byte* cr, byte* output, const uint width) {
+		const int half = 1 << (ColorBits - 1);
+		for (uint x = 0; x < width; x++, output += bytesPerPixel) {
+			const int blueDifference = cb[x] - 128;
+			const int redDifference = cr[x] - 128;
+			output[red] = ClampSample(y[x] - 128 + ((FIX_1_40200 * redDifference + half) >> ColorBits));
+			output[green] = ClampSample(y[x] - 128 + ((-FIX_0_34414 * blueDifference - FIX_0_71414 * redDifference + half) >> ColorBits));
+			output[blue] = ClampSample(y[x] - 128 + ((FIX_1_77200 * blueDifference + half) >> ColorBits));
+			if (bytesPerPixel == 4) {
+				output[3] = 255;
+			}
+		}
+	}
+
+	void YCbCrToRGBScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		YCbCrToPixels<0, 1, 2, 3>(y, cb, cr, output, width);
+	}
+
+	void YCbCrToBGRScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		YCbCrToPixels<2, 1, 0, 3>(y, cb, cr, output, width);
+	}
+
+	void YCbCrToRGBAScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		YCbCrToPixels<0, 1, 2, 4>(y, cb, cr, output, width);
+	}
+
+	void GrayToRGBScalar(const byte* gray, byte* output, uint width) {
+		for (uint x = 0; x < width; x++, output += 3) {
+			output[0] = output[1] = output[2] = gray[x];
+		}
+	}
+
+	void GrayToRGBAScalar(const byte* gray, byte* output, uint width) {
+		for (uint x = 0; x < width; x++, output += 4) {
+			output[0] = output[1] = output[2] = gray[x];
+			output[3] = 255;
+		}
+	}
+
+
+
+	// --- Kernel Dispatch --- \\
+
+
+
+#if JPG_X86
+	static void CPUID(const uint leaf, const uint subleaf, uint registers[4]) {
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuidex(info, int(leaf), int(subleaf));
+		for (uint i = 0; i < 4; i++) {
+			registers[i] = uint(info[i]);
+		}
+#else
+		__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+	}
+
+	// which register states the OS saves on context switches
+	static uint64_t XGETBV() {
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		uint low, high;
+		__asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+		return (uint64_t(high) << 32) | low;
+#endif
+	}
+#endif
+
+	SIMDLevel DetectSIMDLevel() {
+		static const SIMDLevel level = []() {
+#if JPG_X86
+			uint leaf0[4], leaf1[4], leaf7[4] = { 0 };
+			CPUID(0, 0, leaf0);
+			CPUID(1, 0, leaf1);
+			if (leaf0[0] >= 7) {
+				CPUID(7, 0, leaf7);
+			}
+
+			const bool sse2 = (leaf1[3] >> 26) & 1;
+			const bool osxsave = (leaf1[2] >> 27) & 1;
+			const uint64_t xcr0 = osxsave ? XGETBV() : 0;
+			const bool avxState = (xcr0 & 0x06) == 0x06;
+			const bool avx512State = (xcr0 & 0xE6) == 0xE6;
+			const bool avx2 = (leaf7[1] >> 5) & 1;
+			const bool avx512 = ((leaf7[1] >> 16) & 1) && ((leaf7[1] >> 30) & 1);
+
+			if (avx512 && avx512State) {
+				return SIMDLevel::AVX512;
+			}
+			if (avx2 && avxState) {
+				return SIMDLevel::AVX2;
+			}
+			if (sse2) {
+				return SIMDLevel::SSE2;
+			}
+#endif
+			return SIMDLevel::Scalar;
+		}();
+		return level;
+	}
+
+	const Kernels& GetKernels(SIMDLevel level) {
+		static const Kernels scalar = { SIMDLevel::Scalar, DequantizeIDCTScalar, UpsampleH2V1Scalar, UpsampleH2V2Scalar, UpsampleH1V2Scalar,
+			YCbCrToRGBScalar, YCbCrToBGRScalar, YCbCrToRGBAScalar, GrayToRGBScalar, GrayToRGBAScalar };
+#if JPG_X86
+		static const Kernels sse2 = { SIMDLevel::SSE2, DequantizeIDCTSSE2, UpsampleH2V1SSE2, UpsampleH2V2SSE2, UpsampleH1V2SSE2,
+			YCbCrToRGBSSE2, YCbCrToBGRSSE2, YCbCrToRGBASSE2, GrayToRGBSSE2, GrayToRGBASSE2 };
+		static const Kernels avx2 = { SIMDLevel::AVX2, DequantizeIDCTAVX2, UpsampleH2V1AVX2, UpsampleH2V2AVX2, UpsampleH1V2AVX2,
+			YCbCrToRGBAVX2, YCbCrToBGRAVX2, YCbCrToRGBAAVX2, GrayToRGBAVX2, GrayToRGBAAVX2 };
+		// upsampling and color conversion have no AVX-512 versions, they are memory bound at 32 samples per instruction already
+		static const Kernels avx512 = { SIMDLevel::AVX512, DequantizeIDCTAVX512, UpsampleH2V1AVX2, UpsampleH2V2AVX2, UpsampleH1V2AVX2,
+			YCbCrToRGBAVX2, YCbCrToBGRAVX2, YCbCrToRGBAAVX2, GrayToRGBAVX2, GrayToRGBAAVX2 };
+
+		level = std::min(level, DetectSIMDLevel());
+		switch (level) {
+		case SIMDLevel::AVX512:
+			return avx512;
+		case SIMDLevel::AVX2:
+			return avx2;
+		case SIMDLevel::SSE2:
+			return sse2;
+		default:
+			break;
+		}
+#endif
+		return scalar;
+	}
+
+	DequantizeIDCTKernel GetDequantizeIDCTKernel(const Kernels& kernels, const uint blockSize) {
+		switch (blockSize) {
+		case 1:
+			return DequantizeIDCT1x1Scalar;
+		case 2:
+			return DequantizeIDCT2x2Scalar;
+		case 4:
+			return DequantizeIDCT4x4Scalar;
+		default:
+			return kernels.dequantizeIDCT;
+		}
+	}
+
+	const Kernels& GetKernels() {
+		static const Kernels& kernels = GetKernels(DetectSIMDLevel());
+		return kernels;
+	}
+}
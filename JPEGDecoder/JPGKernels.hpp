@@ -0,0 +1,195 @@
+#pragma once
+#include "JPGDecoder.hpp"
+#include <cstddef>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define JPG_X86 1
+#else
+#define JPG_X86 0
+#endif
+
+namespace JPG {
+	// --- Integer IDCT constants --- \\
+
+	// cos(n * pi / 16) evaluated at compile time with a taylor series
+	constexpr double CosPi16(const int n) {
+		const double x = n * 3.14159265358979323846 / 16.0;
+		double term = 1.0;
+		double sum = 1.0;
+		for (int i = 1; i < 20; i++) {
+			term *= -x * x / ((2.0 * i - 1.0) * (2.0 * i));
+			sum += term;
+		}
+		return sum;
+	}
+
+	// fixed point constants for the integer IDCT (Loeffler, Ligtenberg & Moschytz factorization, same as libjpeg's islow)
+	const int IDCTConstBits = 13;
+	const int IDCTPass1Bits = 2;
+
+	constexpr int IDCTFix(const double x) {
+		return int(x * (1 << IDCTConstBits) + (x < 0 ? -0.5 : 0.5));
+	}
+
+	constexpr double Sqrt2 = 2.0 * CosPi16(4);
+	constexpr int FIX_0_298631336 = IDCTFix(Sqrt2 * (-CosPi16(1) + CosPi16(3) + CosPi16(5) - CosPi16(7)));
+	constexpr int FIX_0_390180644 = IDCTFix(Sqrt2 * (CosPi16(3) - CosPi16(5)));
+	constexpr int FIX_0_541196100 = IDCTFix(Sqrt2 * CosPi16(6));
+	constexpr int FIX_0_765366865 = IDCTFix(Sqrt2 * (CosPi16(2) - CosPi16(6)));
+	constexpr int FIX_0_899976223 = IDCTFix(Sqrt2 * (CosPi16(3) - CosPi16(7)));
+	constexpr int FIX_1_175875602 = IDCTFix(Sqrt2 * CosPi16(3));
+	constexpr int FIX_1_501321110 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(3) - CosPi16(5) - CosPi16(7)));
+	constexpr int FIX_1_847759065 = IDCTFix(Sqrt2 * (CosPi16(2) + CosPi16(6)));
+	constexpr int FIX_1_961570560 = IDCTFix(Sqrt2 * (CosPi16(3) + CosPi16(5)));
+	constexpr int FIX_2_053119869 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(3) - CosPi16(5) + CosPi16(7)));
+	constexpr int FIX_2_562915447 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(3)));
+	constexpr int FIX_3_072711026 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(3) + CosPi16(5) - CosPi16(7)));
+
+	static_assert(FIX_0_541196100 == 4433 && FIX_1_175875602 == 9633 && FIX_3_072711026 == 25172, "IDCT constants are wrong");
+
+	// constants of the reduced size IDCTs (libjpeg's jidctred.c)
+	constexpr int FIX_0_211164243 = IDCTFix(Sqrt2 * (CosPi16(1) - CosPi16(3)));
+	constexpr int FIX_0_509795579 = IDCTFix(Sqrt2 * (CosPi16(5) - CosPi16(7)));
+	constexpr int FIX_0_601344887 = IDCTFix(Sqrt2 * (CosPi16(1) - CosPi16(5)));
+	constexpr int FIX_0_720959822 = IDCTFix(Sqrt2 * (CosPi16(1) - CosPi16(3) + CosPi16(5) - CosPi16(7)));
+	constexpr int FIX_0_850430095 = IDCTFix(Sqrt2 * (-CosPi16(1) + CosPi16(3) + CosPi16(5) + CosPi16(7)));
+	constexpr int FIX_1_061594337 = IDCTFix(Sqrt2 * (CosPi16(5) + CosPi16(7)));
+	constexpr int FIX_1_272758580 = IDCTFix(Sqrt2 * (CosPi16(1) - CosPi16(3) + CosPi16(5) + CosPi16(7)));
+	constexpr int FIX_1_451774981 = IDCTFix(Sqrt2 * (CosPi16(3) + CosPi16(7)));
+	constexpr int FIX_2_172734803 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(5)));
+	constexpr int FIX_3_624509785 = IDCTFix(Sqrt2 * (CosPi16(1) + CosPi16(3) + CosPi16(5) + CosPi16(7)));
+
+	static_assert(FIX_0_211164243 == 1730 && FIX_0_720959822 == 5906 && FIX_3_624509785 == 29692, "reduced IDCT constants are wrong");
+
+	// separable fixed point IDCT of a dequantized block, outputs samples centered around 0 (not clamped)
+	void IntegerIDCTBlock(int block[64]);
+
+
+
+	// --- Color conversion constants --- \\
+
+	// YCbCr -> RGB in 16 bit fixed point with the same rounding as libjpeg:
+	// R = Y + 1.402 Cr, G = Y - 0.34414 Cb - 0.71414 Cr, B = Y + 1.772 Cb (Cb and Cr centered around 0)
+	const int ColorBits = 16;
+
+	constexpr int ColorFix(const double x) {
+		return int(x * (1 << ColorBits) + 0.5);
+	}
+
+	constexpr int FIX_1_40200 = ColorFix(1.40200);
+	constexpr int FIX_0_34414 = ColorFix(0.34414);
+	constexpr int FIX_0_71414 = ColorFix(0.71414);
+	constexpr int FIX_1_77200 = ColorFix(1.77200);
+
+	static_assert(FIX_1_40200 == 91881 && FIX_0_34414 == 22554 && FIX_0_71414 == 46802 && FIX_1_77200 == 116130, "color constants are wrong");
+
+
+
+	// --- SIMD Kernels --- \\
+
+	enum class SIMDLevel {
+		Scalar,
+		SSE2,
+		AVX2,
+		AVX512 // AVX-512 F + BW
+	};
+
+	// Dequantizes and inverse transforms numBlocks blocks that lie next to each other in a row.
+	// coefficients holds 64 coefficients per block in natural (not zigzag) order, block i is written to
+	// output + i * 8 as 8 rows of 8 samples (+128 and clamped to 0 - 255) that are stride bytes apart.
+	// Dequantized coefficients are 16 bit like in any valid baseline JPG.
+	// lastCoefficients holds the zigzag index of the last non-zero coefficient of each block (nullptr when it is not
+	// known). Blocks with only a DC coefficient are filled in without a transform, and the SIMD kernels use a shorter
+	// transform for the blocks whose coefficients end within the top left 4x4 (LastCoefficient4x4).
+	using DequantizeIDCTKernel = void(*)(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+
+	// the zigzag order has left the top left 4x4 coefficients of a block after this index
+	const uint LastCoefficient4x4 = 9;
+
+	// every IDCT turns a block that only has a DC coefficient into a single value: the column pass scales it up by
+	// 2^IDCTPass1Bits and the row pass descales it by 2^(IDCTPass1Bits + 3)
+	inline byte DCSample(const int16_t coefficient, const uint16_t quantization) {
+		const int dc = int16_t(coefficient * quantization);
+		return byte(std::min(std::max(((dc + 4) >> 3) + 128, 0), 255));
+	}
+
+	// fills a blockSize x blockSize block that only has a DC coefficient
+	void StoreDCBlock(int16_t coefficient, uint16_t quantization, byte* output, size_t stride, uint blockSize);
+
+	// Fancy upsampling (triangle filter, same results as libjpeg) by 2 of one row of inputWidth samples. The vertical
+	// versions weight the nearest input row by 3/4 and the next nearest one (above or below the output row) by 1/4.
+	using UpsampleH2V1Kernel = void(*)(const byte* input, byte* output, uint inputWidth);
+	using UpsampleH2V2Kernel = void(*)(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth);
+	// farIsBelow selects the rounding for the lower of the two output rows
+	using UpsampleH1V2Kernel = void(*)(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow);
+
+	// Color conversion of width pixels from rows of Y, Cb and Cr samples into RGB8, BGR8 or RGBA8 pixels.
+	// Every level gives exactly the same results.
+	using YCbCrToRGBKernel = void(*)(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	// gray samples repeated into RGB8 (the same as BGR8) or RGBA8 pixels
+	using GrayToRGBKernel = void(*)(const byte* gray, byte* output, uint width);
+
+	struct Kernels {
+		SIMDLevel level;
+		DequantizeIDCTKernel dequantizeIDCT;
+		UpsampleH2V1Kernel upsampleH2V1;
+		UpsampleH2V2Kernel upsampleH2V2;
+		UpsampleH1V2Kernel upsampleH1V2;
+		YCbCrToRGBKernel ycbcrToRGB;
+		YCbCrToRGBKernel ycbcrToBGR;
+		YCbCrToRGBKernel ycbcrToRGBA;
+		GrayToRGBKernel grayToRGB;
+		GrayToRGBKernel grayToRGBA;
+	};
+
+	// kernel for blocks that are decoded to blockSize x blockSize samples (8, 4, 2 or 1) for scaled decoding.
+	// The reduced sizes are scalar on every level, they skip most of the work already.
+	DequantizeIDCTKernel GetDequantizeIDCTKernel(const Kernels& kernels, uint blockSize);
+
+	// best SIMD level that this CPU (and OS) supports, checked once
+	SIMDLevel DetectSIMDLevel();
+
+	// kernels for the given level, levels that are not supported fall back to the next lower one
+	const Kernels& GetKernels(SIMDLevel level);
+	const Kernels& GetKernels();
+
+	// per instruction set implementations (JPGKernels<ISA>.cpp)
+	void DequantizeIDCTScalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void DequantizeIDCT4x4Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void DequantizeIDCT2x2Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void DequantizeIDCT1x1Scalar(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void UpsampleH2V1Scalar(const byte* input, byte* output, uint inputWidth);
+	void UpsampleH2V2Scalar(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth);
+	void UpsampleH1V2Scalar(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow);
+	void YCbCrToRGBScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToBGRScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToRGBAScalar(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void GrayToRGBScalar(const byte* gray, byte* output, uint width);
+	void GrayToRGBAScalar(const byte* gray, byte* output, uint width);
+#if JPG_X86
+	void DequantizeIDCTSSE2(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void UpsampleH2V1SSE2(const byte* input, byte* output, uint inputWidth);
+	void UpsampleH2V2SSE2(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth);
+	void UpsampleH1V2SSE2(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow);
+	void YCbCrToRGBSSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToBGRSSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToRGBASSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void GrayToRGBSSE2(const byte* gray, byte* output, uint width);
+	void GrayToRGBASSE2(const byte* gray, byte* output, uint width);
+	void DequantizeIDCTAVX2(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+	void UpsampleH2V1AVX2(const byte* input, byte* output, uint inputWidth);
+	void UpsampleH2V2AVX2(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth);
+	void UpsampleH1V2AVX2(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow);
+	void YCbCrToRGBAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToBGRAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void YCbCrToRGBAAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width);
+	void GrayToRGBAVX2(const byte* gray, byte* output, uint width);
+	void GrayToRGBAAVX2(const byte* gray, byte* output, uint width);
+	void DequantizeIDCTAVX512(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks);
+#endif
+
+	// scalar upsampling of the output columns 2 * first to 2 * end - 1, the SIMD kernels use it for the ends of a row
+	void UpsampleH2V1Columns(const byte* input, byte* output, uint first, uint end, uint inputWidth);
+	void UpsampleH2V2Columns(const byte* nearRow, const byte* farRow, byte* output, uint first, uint end, uint inputWidth);
+}
@@ -0,0 +1,130 @@
+#include "JPGKernels.hpp"
+
+#if JPG_X86
+#include <immintrin.h>
+#include "JPGKernelsSIMD.hpp"
+
+namespace JPG {
+	namespace {
+		// two blocks per register, block i + 1 in the upper 128 bit lane
+		struct AVX2 {
+			using reg = __m256i;
+			static const uint lanes = 2;
+
+			static reg load(const int16_t* p) {
+				const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+				const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 64));
+				return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+			}
+			static reg loadQuant(const uint16_t* p) { return _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+			static reg zero() { return _mm256_setzero_si256(); }
+			static reg set16(const int x) { return _mm256_set1_epi16(int16_t(x)); }
+			static reg set32(const int x) { return _mm256_set1_epi32(x); }
+			static reg add16(const reg a, const reg b) { return _mm256_add_epi16(a, b); }
+			static reg sub16(const reg a, const reg b) { return _mm256_sub_epi16(a, b); }
+			static reg mullo16(const reg a, const reg b) { return _mm256_mullo_epi16(a, b); }
+			static reg add32(const reg a, const reg b) { return _mm256_add_epi32(a, b); }
+			static reg sub32(const reg a, const reg b) { return _mm256_sub_epi32(a, b); }
+			static reg madd16(const reg a, const reg b) { return _mm256_madd_epi16(a, b); }
+			template<int n> static reg srai32(const reg a) { return _mm256_srai_epi32(a, n); }
+			static reg unpacklo16(const reg a, const reg b) { return _mm256_unpacklo_epi16(a, b); }
+			static reg unpackhi16(const reg a, const reg b) { return _mm256_unpackhi_epi16(a, b); }
+			static reg unpacklo32(const reg a, const reg b) { return _mm256_unpacklo_epi32(a, b); }
+			static reg unpackhi32(const reg a, const reg b) { return _mm256_unpackhi_epi32(a, b); }
+			static reg unpacklo64(const reg a, const reg b) { return _mm256_unpacklo_epi64(a, b); }
+			static reg unpackhi64(const reg a, const reg b) { return _mm256_unpackhi_epi64(a, b); }
+			static reg packs32(const reg a, const reg b) { return _mm256_packs_epi32(a, b); }
+			static reg packus16(const reg a, const reg b) { return _mm256_packus_epi16(a, b); }
+
+			// [block 0 row r, block 0 row r + 1 | block 1 row r, block 1 row r + 1] -> two 16 byte rows
+			static void storeRows(byte* p, const size_t stride, const reg rows) {
+				const reg ordered = _mm256_permute4x64_epi64(rows, 0xD8);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(ordered));
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(p + stride), _mm256_extracti128_si256(ordered, 1));
+			}
+
+			static reg loadSamples(const byte* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+			static __m128i lane(const reg a, const uint k) { return k == 0 ? _mm256_castsi256_si128(a) : _mm256_extracti128_si256(a, 1); }
+		};
+
+	}
+
+	void DequantizeIDCTAVX2(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		DequantizeIDCTRow<AVX2>(coefficients, lastCoefficients, quantizationTable, output, stride, numBlocks);
+	}
+
+	// same as the SSE2 versions with 16 input samples at a time
+	static __m256i LoadSamples16(const byte* p) {
+		return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+	}
+
+	void UpsampleH2V1AVX2(const byte* input, byte* output, uint inputWidth) {
+		UpsampleH2V1Columns(input, output, 0, 1, inputWidth);
+		uint i = 1;
+		for (; i + 17 <= inputWidth; i += 16) {
+			const __m256i sample = LoadSamples16(input + i);
+			const __m256i tripled = _mm256_add_epi16(sample, _mm256_add_epi16(sample, sample));
+			const __m256i even = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(tripled, LoadSamples16(input + i - 1)), _mm256_set1_epi16(1)), 2);
+			const __m256i odd = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(tripled, LoadSamples16(input + i + 1)), _mm256_set1_epi16(2)), 2);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 2 * i), _mm256_or_si256(even, _mm256_slli_epi16(odd, 8)));
+		}
+		UpsampleH2V1Columns(input, output, i, inputWidth, inputWidth);
+	}
+
+	void UpsampleH2V2AVX2(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth) {
+		auto columnSum = [nearRow, farRow](const uint i) {
+			const __m256i nearSample = LoadSamples16(nearRow + i);
+			return _mm256_add_epi16(_mm256_add_epi16(nearSample, _mm256_add_epi16(nearSample, nearSample)), LoadSamples16(farRow + i));
+		};
+		UpsampleH2V2Columns(nearRow, farRow, output, 0, 1, inputWidth);
+		uint i = 1;
+		for (; i + 17 <= inputWidth; i += 16) {
+			const __m256i sum = columnSum(i);
+			const __m256i tripled = _mm256_add_epi16(sum, _mm256_add_epi16(sum, sum));
+			const __m256i even = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(tripled, columnSum(i - 1)), _mm256_set1_epi16(8)), 4);
+			const __m256i odd = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(tripled, columnSum(i + 1)), _mm256_set1_epi16(7)), 4);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(output + 2 * i), _mm256_or_si256(even, _mm256_slli_epi16(odd, 8)));
+		}
+		UpsampleH2V2Columns(nearRow, farRow, output, i, inputWidth, inputWidth);
+	}
+
+	void UpsampleH1V2AVX2(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow) {
+		const __m256i bias = _mm256_set1_epi16(farIsBelow ? 2 : 1);
+		uint i = 0;
+		for (; i + 16 <= width; i += 16) {
+			const __m256i nearSample = LoadSamples16(nearRow + i);
+			const __m256i tripled = _mm256_add_epi16(nearSample, _mm256_add_epi16(nearSample, nearSample));
+			const __m256i blended = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(tripled, LoadSamples16(farRow + i)), bias), 2);
+			// packus works within 128 bit lanes, bring the two 8 byte halves together
+			const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(blended, blended), 0x08);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm256_castsi256_si128(packed));
+		}
+		UpsampleH1V2Scalar(nearRow + i, farRow + i, output + i, width - i, farIsBelow);
+	}
+
+	void YCbCrToRGBAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<AVX2, 0, 1, 2, 3>(y, cb, cr, output, width);
+		YCbCrToRGBScalar(y + i, cb + i, cr + i, output + i * 3, width - i);
+	}
+
+	void YCbCrToBGRAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<AVX2, 2, 1, 0, 3>(y, cb, cr, output, width);
+		YCbCrToBGRScalar(y + i, cb + i, cr + i, output + i * 3, width - i);
+	}
+
+	void YCbCrToRGBAAVX2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<AVX2, 0, 1, 2, 4>(y, cb, cr, output, width);
+		YCbCrToRGBAScalar(y + i, cb + i, cr + i, output + i * 4, width - i);
+	}
+
+	void GrayToRGBAVX2(const byte* gray, byte* output, uint width) {
+		const uint i = GrayToPixels<AVX2, 3>(gray, output, width);
+		GrayToRGBScalar(gray + i, output + i * 3, width - i);
+	}
+
+	void GrayToRGBAAVX2(const byte* gray, byte* output, uint width) {
+		const uint i = GrayToPixels<AVX2, 4>(gray, output, width);
+		GrayToRGBAScalar(gray + i, output + i * 4, width - i);
+	}
+}
+#endif
@@ -0,0 +1,52 @@
+#include "JPGKernels.hpp"
+
+#if JPG_X86
+#include <immintrin.h>
+#include "JPGKernelsSIMD.hpp"
+
+namespace JPG {
+	namespace {
+		// four blocks per register, one per 128 bit lane (needs AVX-512 BW for the 16 bit operations)
+		struct AVX512 {
+			using reg = __m512i;
+			static const uint lanes = 4;
+
+			static reg load(const int16_t* p) {
+				reg blocks = _mm512_castsi128_si512(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+				blocks = _mm512_inserti32x4(blocks, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 64)), 1);
+				blocks = _mm512_inserti32x4(blocks, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 128)), 2);
+				return _mm512_inserti32x4(blocks, _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 192)), 3);
+			}
+			static reg loadQuant(const uint16_t* p) { return _mm512_broadcast_i32x4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+			static reg zero() { return _mm512_setzero_si512(); }
+			static reg set32(const int x) { return _mm512_set1_epi32(x); }
+			static reg add16(const reg a, const reg b) { return _mm512_add_epi16(a, b); }
+			static reg sub16(const reg a, const reg b) { return _mm512_sub_epi16(a, b); }
+			static reg mullo16(const reg a, const reg b) { return _mm512_mullo_epi16(a, b); }
+			static reg add32(const reg a, const reg b) { return _mm512_add_epi32(a, b); }
+			static reg sub32(const reg a, const reg b) { return _mm512_sub_epi32(a, b); }
+			static reg madd16(const reg a, const reg b) { return _mm512_madd_epi16(a, b); }
+			template<int n> static reg srai32(const reg a) { return _mm512_srai_epi32(a, n); }
+			static reg unpacklo16(const reg a, const reg b) { return _mm512_unpacklo_epi16(a, b); }
+			static reg unpackhi16(const reg a, const reg b) { return _mm512_unpackhi_epi16(a, b); }
+			static reg unpacklo32(const reg a, const reg b) { return _mm512_unpacklo_epi32(a, b); }
+			static reg unpackhi32(const reg a, const reg b) { return _mm512_unpackhi_epi32(a, b); }
+			static reg unpacklo64(const reg a, const reg b) { return _mm512_unpacklo_epi64(a, b); }
+			static reg unpackhi64(const reg a, const reg b) { return _mm512_unpackhi_epi64(a, b); }
+			static reg packs32(const reg a, const reg b) { return _mm512_packs_epi32(a, b); }
+			static reg packus16(const reg a, const reg b) { return _mm512_packus_epi16(a, b); }
+
+			// row r and r + 1 of each block -> row r of all four blocks (32 bytes) and row r + 1
+			static void storeRows(byte* p, const size_t stride, const reg rows) {
+				const reg ordered = _mm512_permutexvar_epi64(_mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7), rows);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(p), _mm512_castsi512_si256(ordered));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(p + stride), _mm512_extracti64x4_epi64(ordered, 1));
+			}
+		};
+	}
+
+	void DequantizeIDCTAVX512(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		DequantizeIDCTRow<AVX512>(coefficients, lastCoefficients, quantizationTable, output, stride, numBlocks);
+	}
+}
+#endif
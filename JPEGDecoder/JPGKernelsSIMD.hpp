@@ -0,0 +1,374 @@
+#pragma once
+#include "JPGKernels.hpp"
+#include <emmintrin.h>
+#include <algorithm>
+#include <cstring>
+
+// Instruction set independent SIMD kernels. Each JPGKernels<ISA>.cpp includes this file and instantiates
+// the templates with a vector type V whose 128 bit lanes each hold one 8x8 block. Every V operation works
+// within the 128 bit lanes, so a V with N lanes processes N blocks at once with exactly the same arithmetic.
+// Everything is in an anonymous namespace so the instantiations compiled with different instruction sets
+// never get merged by the linker.
+//
+// V provides:
+//   using reg;                             lanes * 8 int16
+//   static const uint lanes;               blocks per register
+//   load(ptr), loadQuant(ptr)               row of each block (blocks are 64 coefficients apart) / broadcast row of the quantization table
+//   zero(), set32(x)
+//   add16, sub16, mullo16, add32, sub32, madd16, srai32<n>
+//   unpacklo16/32/64, unpackhi16/32/64, packs32, packus16
+//   storeRows(ptr, stride, reg)            reg holds rows r and r + 1 (8 bytes each) for each block
+//
+// The color conversion also needs:
+//   set16(x), loadSamples(ptr)              lanes * 8 samples widened to 16 bit
+//   lane(reg, k)                           128 bit lane k
+namespace JPG {
+	namespace {
+		// 32 bit lane value with a in the low and b in the high 16 bits, for madd16
+		constexpr int MaddPair(const int a, const int b) {
+			return int((uint(b) << 16) | (uint(a) & 0xFFFF));
+		}
+
+		// one block per register, also used by the wider instruction sets for the blocks left over at the end of a row
+		struct SSE2 {
+			using reg = __m128i;
+			static const uint lanes = 1;
+
+			static reg load(const int16_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+			static reg loadQuant(const uint16_t* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+			static reg zero() { return _mm_setzero_si128(); }
+			static reg set16(const int x) { return _mm_set1_epi16(int16_t(x)); }
+			static reg set32(const int x) { return _mm_set1_epi32(x); }
+			static reg add16(const reg a, const reg b) { return _mm_add_epi16(a, b); }
+			static reg sub16(const reg a, const reg b) { return _mm_sub_epi16(a, b); }
+			static reg mullo16(const reg a, const reg b) { return _mm_mullo_epi16(a, b); }
+			static reg add32(const reg a, const reg b) { return _mm_add_epi32(a, b); }
+			static reg sub32(const reg a, const reg b) { return _mm_sub_epi32(a, b); }
+			static reg madd16(const reg a, const reg b) { return _mm_madd_epi16(a, b); }
+			template<int n> static reg srai32(const reg a) { return _mm_srai_epi32(a, n); }
+			static reg unpacklo16(const reg a, const reg b) { return _mm_unpacklo_epi16(a, b); }
+			static reg unpackhi16(const reg a, const reg b) { return _mm_unpackhi_epi16(a, b); }
+			static reg unpacklo32(const reg a, const reg b) { return _mm_unpacklo_epi32(a, b); }
+			static reg unpackhi32(const reg a, const reg b) { return _mm_unpackhi_epi32(a, b); }
+			static reg unpacklo64(const reg a, const reg b) { return _mm_unpacklo_epi64(a, b); }
+			static reg unpackhi64(const reg a, const reg b) { return _mm_unpackhi_epi64(a, b); }
+			static reg packs32(const reg a, const reg b) { return _mm_packs_epi32(a, b); }
+			static reg packus16(const reg a, const reg b) { return _mm_packus_epi16(a, b); }
+
+			static void storeRows(byte* p, const size_t stride, const reg rows) {
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(p), rows);
+				_mm_storel_epi64(reinterpret_cast<__m128i*>(p + stride), _mm_unpackhi_epi64(rows, rows));
+			}
+
+			static reg loadSamples(const byte* p) { return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128()); }
+			static __m128i lane(const reg a, const uint) { return a; }
+		};
+
+		template<class V>
+		inline void Transpose8x8(typename V::reg r[8]) {
+			using reg = typename V::reg;
+			const reg a0 = V::unpacklo16(r[0], r[1]);
+			const reg a1 = V::unpackhi16(r[0], r[1]);
+			const reg a2 = V::unpacklo16(r[2], r[3]);
+			const reg a3 = V::unpackhi16(r[2], r[3]);
+			const reg a4 = V::unpacklo16(r[4], r[5]);
+			const reg a5 = V::unpackhi16(r[4], r[5]);
+			const reg a6 = V::unpacklo16(r[6], r[7]);
+			const reg a7 = V::unpackhi16(r[6], r[7]);
+
+			const reg b0 = V::unpacklo32(a0, a2);
+			const reg b1 = V::unpackhi32(a0, a2);
+			const reg b2 = V::unpacklo32(a1, a3);
+			const reg b3 = V::unpackhi32(a1, a3);
+			const reg b4 = V::unpacklo32(a4, a6);
+			const reg b5 = V::unpackhi32(a4, a6);
+			const reg b6 = V::unpacklo32(a5, a7);
+			const reg b7 = V::unpackhi32(a5, a7);
+
+			r[0] = V::unpacklo64(b0, b4);
+			r[1] = V::unpackhi64(b0, b4);
+			r[2] = V::unpacklo64(b1, b5);
+			r[3] = V::unpackhi64(b1, b5);
+			r[4] = V::unpacklo64(b2, b6);
+			r[5] = V::unpackhi64(b2, b6);
+			r[6] = V::unpacklo64(b3, b7);
+			r[7] = V::unpackhi64(b3, b7);
+		}
+
+		// one IDCT pass over the vectors in[0] - in[7] (element k of the 1D transform for 8 columns per block).
+		// Same arithmetic as IDCT1D in JPGKernels.cpp, but the products are formed with 16 bit multiply-adds
+		// of interleaved pairs, e.g. tmp3 = z2 * (F0541 + F0765) + z3 * F0541 = (z2 + z3) * F0541 + z2 * F0765.
+		template<class V, int shift>
+		inline void IDCTPass(typename V::reg in[8], const int rounding) {
+			using reg = typename V::reg;
+			const reg zero = V::zero();
+			const reg round = V::set32(rounding);
+
+			// even part
+			const reg z23lo = V::unpacklo16(in[2], in[6]);
+			const reg z23hi = V::unpackhi16(in[2], in[6]);
+			const reg tmp3lo = V::madd16(z23lo, V::set32(MaddPair(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100)));
+			const reg tmp3hi = V::madd16(z23hi, V::set32(MaddPair(FIX_0_541196100 + FIX_0_765366865, FIX_0_541196100)));
+			const reg tmp2lo = V::madd16(z23lo, V::set32(MaddPair(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065)));
+			const reg tmp2hi = V::madd16(z23hi, V::set32(MaddPair(FIX_0_541196100, FIX_0_541196100 - FIX_1_847759065)));
+
+			// (x << 16) >> (16 - IDCTConstBits) == x << IDCTConstBits for the 16 bit x
+			const reg sum04 = V::add16(in[0], in[4]);
+			const reg difference04 = V::sub16(in[0], in[4]);
+			const reg tmp0lo = V::template srai32<16 - IDCTConstBits>(V::unpacklo16(zero, sum04));
+			const reg tmp0hi = V::template srai32<16 - IDCTConstBits>(V::unpackhi16(zero, sum04));
+			const reg tmp1lo = V::template srai32<16 - IDCTConstBits>(V::unpacklo16(zero, difference04));
+			const reg tmp1hi = V::template srai32<16 - IDCTConstBits>(V::unpackhi16(zero, difference04));
+
+			const reg tmp10lo = V::add32(tmp0lo, tmp3lo);
+			const reg tmp10hi = V::add32(tmp0hi, tmp3hi);
+			const reg tmp13lo = V::sub32(tmp0lo, tmp3lo);
+			const reg tmp13hi = V::sub32(tmp0hi, tmp3hi);
+			const reg tmp11lo = V::add32(tmp1lo, tmp2lo);
+			const reg tmp11hi = V::add32(tmp1hi, tmp2hi);
+			const reg tmp12lo = V::sub32(tmp1lo, tmp2lo);
+			const reg tmp12hi = V::sub32(tmp1hi, tmp2hi);
+
+			// odd part
+			const reg z3 = V::add16(in[7], in[3]);
+			const reg z4 = V::add16(in[5], in[1]);
+			const reg z34lo = V::unpacklo16(z3, z4);
+			const reg z34hi = V::unpackhi16(z3, z4);
+			const reg z3lo = V::madd16(z34lo, V::set32(MaddPair(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602)));
+			const reg z3hi = V::madd16(z34hi, V::set32(MaddPair(FIX_1_175875602 - FIX_1_961570560, FIX_1_175875602)));
+			const reg z4lo = V::madd16(z34lo, V::set32(MaddPair(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644)));
+			const reg z4hi = V::madd16(z34hi, V::set32(MaddPair(FIX_1_175875602, FIX_1_175875602 - FIX_0_390180644)));
+
+			const reg in71lo = V::unpacklo16(in[7], in[1]);
+			const reg in71hi = V::unpackhi16(in[7], in[1]);
+			const reg odd0lo = V::add32(V::madd16(in71lo, V::set32(MaddPair(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223))), z3lo);
+			const reg odd0hi = V::add32(V::madd16(in71hi, V::set32(MaddPair(FIX_0_298631336 - FIX_0_899976223, -FIX_0_899976223))), z3hi);
+			const reg odd3lo = V::add32(V::madd16(in71lo, V::set32(MaddPair(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223))), z4lo);
+			const reg odd3hi = V::add32(V::madd16(in71hi, V::set32(MaddPair(-FIX_0_899976223, FIX_1_501321110 - FIX_0_899976223))), z4hi);
+
+			const reg in53lo = V::unpacklo16(in[5], in[3]);
+			const reg in53hi = V::unpackhi16(in[5], in[3]);
+			const reg odd1lo = V::add32(V::madd16(in53lo, V::set32(MaddPair(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447))), z4lo);
+			const reg odd1hi = V::add32(V::madd16(in53hi, V::set32(MaddPair(FIX_2_053119869 - FIX_2_562915447, -FIX_2_562915447))), z4hi);
+			const reg odd2lo = V::add32(V::madd16(in53lo, V::set32(MaddPair(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447))), z3lo);
+			const reg odd2hi = V::add32(V::madd16(in53hi, V::set32(MaddPair(-FIX_2_562915447, FIX_3_072711026 - FIX_2_562915447))), z3hi);
+
+			auto output = [&round](const reg lo, const reg hi) {
+				return V::packs32(V::template srai32<shift>(V::add32(lo, round)), V::template srai32<shift>(V::add32(hi, round)));
+			};
+			in[0] = output(V::add32(tmp10lo, odd3lo), V::add32(tmp10hi, odd3hi));
+			in[7] = output(V::sub32(tmp10lo, odd3lo), V::sub32(tmp10hi, odd3hi));
+			in[1] = output(V::add32(tmp11lo, odd2lo), V::add32(tmp11hi, odd2hi));
+			in[6] = output(V::sub32(tmp11lo, odd2lo), V::sub32(tmp11hi, odd2hi));
+			in[2] = output(V::add32(tmp12lo, odd1lo), V::add32(tmp12hi, odd1hi));
+			in[5] = output(V::sub32(tmp12lo, odd1lo), V::sub32(tmp12hi, odd1hi));
+			in[3] = output(V::add32(tmp13lo, odd0lo), V::add32(tmp13hi, odd0hi));
+			in[4] = output(V::sub32(tmp13lo, odd0lo), V::sub32(tmp13hi, odd0hi));
+		}
+
+		// IDCTPass for blocks whose coefficients end within the top left 4x4, so in[4] - in[7] are zero. The products of
+		// the zero inputs drop out and each term of the outputs is one multiply-add of (in[0], in[2]) or (in[1], in[3]).
+		template<class V, int shift>
+		inline void IDCTPassLow(typename V::reg in[8], const int rounding) {
+			using reg = typename V::reg;
+			const reg round = V::set32(rounding);
+
+			// even part, tmp0 = tmp1 = in[0] << IDCTConstBits
+			const reg in02lo = V::unpacklo16(in[0], in[2]);
+			const reg in02hi = V::unpackhi16(in[0], in[2]);
+			const reg tmp10lo = V::madd16(in02lo, V::set32(MaddPair(1 << IDCTConstBits, FIX_0_541196100 + FIX_0_765366865)));
+			const reg tmp10hi = V::madd16(in02hi, V::set32(MaddPair(1 << IDCTConstBits, FIX_0_541196100 + FIX_0_765366865)));
+			const reg tmp13lo = V::madd16(in02lo, V::set32(MaddPair(1 << IDCTConstBits, -FIX_0_541196100 - FIX_0_765366865)));
+			const reg tmp13hi = V::madd16(in02hi, V::set32(MaddPair(1 << IDCTConstBits, -FIX_0_541196100 - FIX_0_765366865)));
+			const reg tmp11lo = V::madd16(in02lo, V::set32(MaddPair(1 << IDCTConstBits, FIX_0_541196100)));
+			const reg tmp11hi = V::madd16(in02hi, V::set32(MaddPair(1 << IDCTConstBits, FIX_0_541196100)));
+			const reg tmp12lo = V::madd16(in02lo, V::set32(MaddPair(1 << IDCTConstBits, -FIX_0_541196100)));
+			const reg tmp12hi = V::madd16(in02hi, V::set32(MaddPair(1 << IDCTConstBits, -FIX_0_541196100)));
+
+			// odd part, z1 = z4 = in[1] and z2 = z3 = in[3]
+			const reg in13lo = V::unpacklo16(in[1], in[3]);
+			const reg in13hi = V::unpackhi16(in[1], in[3]);
+			const reg odd0lo = V::madd16(in13lo, V::set32(MaddPair(FIX_1_175875602 - FIX_0_899976223, FIX_1_175875602 - FIX_1_961570560)));
+			const reg odd0hi = V::madd16(in13hi, V::set32(MaddPair(FIX_1_175875602 - FIX_0_899976223, FIX_1_175875602 - FIX_1_961570560)));
+			const reg odd1lo = V::madd16(in13lo, V::set32(MaddPair(FIX_1_175875602 - FIX_0_390180644, FIX_1_175875602 - FIX_2_562915447)));
+			const reg odd1hi = V::madd16(in13hi, V::set32(MaddPair(FIX_1_175875602 - FIX_0_390180644, FIX_1_175875602 - FIX_2_562915447)));
+			const reg odd2lo = V::madd16(in13lo, V::set32(MaddPair(FIX_1_175875602, FIX_3_072711026 - FIX_2_562915447 - FIX_1_961570560 + FIX_1_175875602)));
+			const reg odd2hi = V::madd16(in13hi, V::set32(MaddPair(FIX_1_175875602, FIX_3_072711026 - FIX_2_562915447 - FIX_1_961570560 + FIX_1_175875602)));
+			const reg odd3lo = V::madd16(in13lo, V::set32(MaddPair(FIX_1_501321110 - FIX_0_899976223 - FIX_0_390180644 + FIX_1_175875602, FIX_1_175875602)));
+			const reg odd3hi = V::madd16(in13hi, V::set32(MaddPair(FIX_1_501321110 - FIX_0_899976223 - FIX_0_390180644 + FIX_1_175875602, FIX_1_175875602)));
+
+			auto output = [&round](const reg lo, const reg hi) {
+				return V::packs32(V::template srai32<shift>(V::add32(lo, round)), V::template srai32<shift>(V::add32(hi, round)));
+			};
+			in[0] = output(V::add32(tmp10lo, odd3lo), V::add32(tmp10hi, odd3hi));
+			in[7] = output(V::sub32(tmp10lo, odd3lo), V::sub32(tmp10hi, odd3hi));
+			in[1] = output(V::add32(tmp11lo, odd2lo), V::add32(tmp11hi, odd2hi));
+			in[6] = output(V::sub32(tmp11lo, odd2lo), V::sub32(tmp11hi, odd2hi));
+			in[2] = output(V::add32(tmp12lo, odd1lo), V::add32(tmp12hi, odd1hi));
+			in[5] = output(V::sub32(tmp12lo, odd1lo), V::sub32(tmp12hi, odd1hi));
+			in[3] = output(V::add32(tmp13lo, odd0lo), V::add32(tmp13hi, odd0hi));
+			in[4] = output(V::sub32(tmp13lo, odd0lo), V::sub32(tmp13hi, odd0hi));
+		}
+
+		// dequantizes and transforms V::lanes blocks, low when all their coefficients are in the top left 4x4
+		// (the column pass then leaves the columns 4 - 7 at zero, so the row pass has the same zero inputs)
+		template<class V, bool low>
+		inline void DequantizeIDCTBlocks(const int16_t* coefficients, const uint16_t quantizationTable[64], byte* output, const size_t stride) {
+			typename V::reg rows[8];
+			for (uint i = 0; i < (low ? 4 : 8); i++) {
+				rows[i] = V::mullo16(V::load(coefficients + i * 8), V::loadQuant(quantizationTable + i * 8));
+			}
+
+			// columns, then rows (the +128 level shift is folded into the rounding of the second pass)
+			const int columnRounding = 1 << (IDCTConstBits - IDCTPass1Bits - 1);
+			const int rowRounding = (1 << (IDCTConstBits + IDCTPass1Bits + 2)) + (128 << (IDCTConstBits + IDCTPass1Bits + 3));
+			if (low) {
+				IDCTPassLow<V, IDCTConstBits - IDCTPass1Bits>(rows, columnRounding);
+				Transpose8x8<V>(rows);
+				IDCTPassLow<V, IDCTConstBits + IDCTPass1Bits + 3>(rows, rowRounding);
+			}
+			else {
+				IDCTPass<V, IDCTConstBits - IDCTPass1Bits>(rows, columnRounding);
+				Transpose8x8<V>(rows);
+				IDCTPass<V, IDCTConstBits + IDCTPass1Bits + 3>(rows, rowRounding);
+			}
+			Transpose8x8<V>(rows);
+
+			for (uint i = 0; i < 8; i += 2) {
+				V::storeRows(output + i * stride, stride, V::packus16(rows[i], rows[i + 1]));
+			}
+		}
+
+		// DequantizeIDCTKernel with V::lanes blocks at a time and single blocks at the end of the row. A group of
+		// blocks takes the transform that its longest block needs, groups of only DC coefficients are just filled in.
+		template<class V>
+		inline void DequantizeIDCTRow(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, const size_t stride, const uint numBlocks) {
+			for (uint i = 0; i < numBlocks;) {
+				const uint n = i + V::lanes <= numBlocks ? V::lanes : 1;
+				uint last = 63;
+				if (lastCoefficients) {
+					last = lastCoefficients[i];
+					for (uint k = 1; k < n; k++) {
+						last = std::max<uint>(last, lastCoefficients[i + k]);
+					}
+				}
+				if (last == 0) {
+					for (uint k = 0; k < n; k++) {
+						const __m128i samples = _mm_set1_epi8(char(DCSample(coefficients[(i + k) * 64], quantizationTable[0])));
+						for (uint y = 0; y < 8; y++) {
+							_mm_storel_epi64(reinterpret_cast<__m128i*>(output + y * stride + (i + k) * 8), samples);
+						}
+					}
+				}
+				else if (n == V::lanes) {
+					if (last <= LastCoefficient4x4) {
+						DequantizeIDCTBlocks<V, true>(coefficients + i * 64, quantizationTable, output + i * 8, stride);
+					}
+					else {
+						DequantizeIDCTBlocks<V, false>(coefficients + i * 64, quantizationTable, output + i * 8, stride);
+					}
+				}
+				else if (last <= LastCoefficient4x4) {
+					DequantizeIDCTBlocks<SSE2, true>(coefficients + i * 64, quantizationTable, output + i * 8, stride);
+				}
+				else {
+					DequantizeIDCTBlocks<SSE2, false>(coefficients + i * 64, quantizationTable, output + i * 8, stride);
+				}
+				i += n;
+			}
+		}
+
+		// 4 pixels of 4 bytes -> the first 3 bytes of each in the low 12 bytes
+		inline __m128i DropFourthBytes(const __m128i pixels) {
+			const __m128i low = _mm_set1_epi64x(0xFFFFFF);
+			const __m128i high = _mm_set1_epi64x(0xFFFFFF000000);
+			// two pixels in the low 6 bytes of each 64 bit half
+			const __m128i pairs = _mm_or_si128(_mm_and_si128(pixels, low), _mm_and_si128(_mm_srli_epi64(pixels, 8), high));
+			return _mm_or_si128(_mm_move_epi64(pairs), _mm_slli_si128(_mm_srli_si128(pairs, 8), 6));
+		}
+
+		// interleaves 8 pixels of 16 bit channels (clamped to 0 - 255 here) into the output, the channels are at the
+		// given byte offsets of a pixel and the fourth byte of 4 byte pixels is 255
+		template<uint red, uint green, uint blue, uint bytesPerPixel>
+		inline void StorePixels8(const __m128i r, const __m128i g, const __m128i b, byte* output) {
+			const __m128i first = red == 0 ? r : blue == 0 ? b : g;
+			const __m128i third = red == 2 ? r : blue == 2 ? b : g;
+			const __m128i channels01 = _mm_packus_epi16(first, g);
+			const __m128i channels23 = _mm_packus_epi16(third, _mm_set1_epi16(255));
+			const __m128i pairs01 = _mm_unpacklo_epi8(channels01, _mm_srli_si128(channels01, 8));
+			const __m128i pairs23 = _mm_unpacklo_epi8(channels23, _mm_srli_si128(channels23, 8));
+			const __m128i pixels0 = _mm_unpacklo_epi16(pairs01, pairs23);
+			const __m128i pixels1 = _mm_unpackhi_epi16(pairs01, pairs23);
+			if (bytesPerPixel == 4) {
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output), pixels0);
+				_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 16), pixels1);
+				return;
+			}
+			// 16 bytes of which the next store overwrites the last 4, then 12 bytes
+			const __m128i packed1 = DropFourthBytes(pixels1);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output), DropFourthBytes(pixels0));
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(output + 12), packed1);
+			const int last = _mm_cvtsi128_si32(_mm_srli_si128(packed1, 8));
+			std::memcpy(output + 20, &last, 4);
+		}
+
+		// Color conversion with the 16 bit constants split up so that every product fits a 16 bit multiply-add:
+		// FIX_1_40200 = 2^16 + 26345, FIX_0_71414 = 2^16 - 18734 and FIX_1_77200 = 2 * 2^16 - 14942, the multiples of
+		// 2^16 are added after the shift. Returns the number of pixels converted, a multiple of 8 * V::lanes.
+		template<class V, uint red, uint green, uint blue, uint bytesPerPixel>
+		inline uint YCbCrToPixels(const byte* y, const byte* cb, const byte* cr, byte* output, const uint width) {
+			using reg = typename V::reg;
+			const reg center = V::set16(128);
+			const reg half = V::set32(1 << (ColorBits - 1));
+			const reg redFactors = V::set32(MaddPair(0, FIX_1_40200 - (1 << ColorBits)));
+			const reg greenFactors = V::set32(MaddPair(-FIX_0_34414, (1 << ColorBits) - FIX_0_71414));
+			const reg blueFactors = V::set32(MaddPair(FIX_1_77200 - 2 * (1 << ColorBits), 0));
+			auto product = [&half](const reg lo, const reg hi, const reg factors) {
+				return V::packs32(V::template srai32<ColorBits>(V::add32(V::madd16(lo, factors), half)),
+					V::template srai32<ColorBits>(V::add32(V::madd16(hi, factors), half)));
+			};
+
+			auto convert = [&](const uint i) {
+				const reg luma = V::loadSamples(y + i);
+				const reg blueDifference = V::sub16(V::loadSamples(cb + i), center);
+				const reg redDifference = V::sub16(V::loadSamples(cr + i), center);
+				const reg lo = V::unpacklo16(blueDifference, redDifference);
+				const reg hi = V::unpackhi16(blueDifference, redDifference);
+				const reg r = V::add16(V::add16(luma, redDifference), product(lo, hi, redFactors));
+				const reg g = V::sub16(V::add16(luma, product(lo, hi, greenFactors)), redDifference);
+				const reg b = V::add16(V::add16(luma, V::add16(blueDifference, blueDifference)), product(lo, hi, blueFactors));
+				for (uint k = 0; k < V::lanes; k++) {
+					StorePixels8<red, green, blue, bytesPerPixel>(V::lane(r, k), V::lane(g, k), V::lane(b, k), output + (i + 8 * k) * bytesPerPixel);
+				}
+			};
+
+			// two registers of pixels per iteration
+			const uint step = 8 * V::lanes;
+			uint i = 0;
+			for (; i + 2 * step <= width; i += 2 * step) {
+				convert(i);
+				convert(i + step);
+			}
+			if (i + step <= width) {
+				convert(i);
+				i += step;
+			}
+			return i;
+		}
+
+		// returns the number of pixels converted like YCbCrToPixels
+		template<class V, uint bytesPerPixel>
+		inline uint GrayToPixels(const byte* gray, byte* output, const uint width) {
+			const uint step = 8 * V::lanes;
+			uint i = 0;
+			for (; i + step <= width; i += step) {
+				const typename V::reg samples = V::loadSamples(gray + i);
+				for (uint k = 0; k < V::lanes; k++) {
+					const __m128i lane = V::lane(samples, k);
+					StorePixels8<0, 1, 2, bytesPerPixel>(lane, lane, lane, output + (i + 8 * k) * bytesPerPixel);
+				}
+			}
+			return i;
+		}
+	}
+}
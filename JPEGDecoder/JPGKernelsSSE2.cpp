@@ -0,0 +1,92 @@
+#include "JPGKernels.hpp"
+
+#if JPG_X86
+#include "JPGKernelsSIMD.hpp"
+
+namespace JPG {
+	void DequantizeIDCTSSE2(const int16_t* coefficients, const byte* lastCoefficients, const uint16_t quantizationTable[64], byte* output, size_t stride, uint numBlocks) {
+		DequantizeIDCTRow<SSE2>(coefficients, lastCoefficients, quantizationTable, output, stride, numBlocks);
+	}
+
+	// The upsampling kernels work on 16 bit values of 8 input samples at a time. An output pair (even, odd)
+	// is written as the 16 bit value even | odd << 8, which puts the bytes in the right order.
+	void UpsampleH2V1SSE2(const byte* input, byte* output, uint inputWidth) {
+		const __m128i zero = _mm_setzero_si128();
+		auto load = [&zero](const byte* p) {
+			return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), zero);
+		};
+		UpsampleH2V1Columns(input, output, 0, 1, inputWidth);
+		uint i = 1;
+		for (; i + 9 <= inputWidth; i += 8) {
+			const __m128i sample = load(input + i);
+			const __m128i tripled = _mm_add_epi16(sample, _mm_add_epi16(sample, sample));
+			const __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tripled, load(input + i - 1)), _mm_set1_epi16(1)), 2);
+			const __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tripled, load(input + i + 1)), _mm_set1_epi16(2)), 2);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 2 * i), _mm_or_si128(even, _mm_slli_epi16(odd, 8)));
+		}
+		UpsampleH2V1Columns(input, output, i, inputWidth, inputWidth);
+	}
+
+	void UpsampleH2V2SSE2(const byte* nearRow, const byte* farRow, byte* output, uint inputWidth) {
+		const __m128i zero = _mm_setzero_si128();
+		auto columnSum = [&zero, nearRow, farRow](const uint i) {
+			const __m128i nearSample = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(nearRow + i)), zero);
+			const __m128i farSample = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(farRow + i)), zero);
+			return _mm_add_epi16(_mm_add_epi16(nearSample, _mm_add_epi16(nearSample, nearSample)), farSample);
+		};
+		UpsampleH2V2Columns(nearRow, farRow, output, 0, 1, inputWidth);
+		uint i = 1;
+		for (; i + 9 <= inputWidth; i += 8) {
+			const __m128i sum = columnSum(i);
+			const __m128i tripled = _mm_add_epi16(sum, _mm_add_epi16(sum, sum));
+			const __m128i even = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tripled, columnSum(i - 1)), _mm_set1_epi16(8)), 4);
+			const __m128i odd = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tripled, columnSum(i + 1)), _mm_set1_epi16(7)), 4);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + 2 * i), _mm_or_si128(even, _mm_slli_epi16(odd, 8)));
+		}
+		UpsampleH2V2Columns(nearRow, farRow, output, i, inputWidth, inputWidth);
+	}
+
+	void UpsampleH1V2SSE2(const byte* nearRow, const byte* farRow, byte* output, uint width, bool farIsBelow) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i bias = _mm_set1_epi16(farIsBelow ? 2 : 1);
+		uint i = 0;
+		for (; i + 16 <= width; i += 16) {
+			const __m128i nearSamples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(nearRow + i));
+			const __m128i farSamples = _mm_loadu_si128(reinterpret_cast<const __m128i*>(farRow + i));
+			auto blend = [&](const __m128i nearSample, const __m128i farSample) {
+				const __m128i tripled = _mm_add_epi16(nearSample, _mm_add_epi16(nearSample, nearSample));
+				return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tripled, farSample), bias), 2);
+			};
+			const __m128i low = blend(_mm_unpacklo_epi8(nearSamples, zero), _mm_unpacklo_epi8(farSamples, zero));
+			const __m128i high = blend(_mm_unpackhi_epi8(nearSamples, zero), _mm_unpackhi_epi8(farSamples, zero));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_packus_epi16(low, high));
+		}
+		UpsampleH1V2Scalar(nearRow + i, farRow + i, output + i, width - i, farIsBelow);
+	}
+
+	void YCbCrToRGBSSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<SSE2, 0, 1, 2, 3>(y, cb, cr, output, width);
+		YCbCrToRGBScalar(y + i, cb + i, cr + i, output + i * 3, width - i);
+	}
+
+	void YCbCrToBGRSSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<SSE2, 2, 1, 0, 3>(y, cb, cr, output, width);
+		YCbCrToBGRScalar(y + i, cb + i, cr + i, output + i * 3, width - i);
+	}
+
+	void YCbCrToRGBASSE2(const byte* y, const byte* cb, const byte* cr, byte* output, uint width) {
+		const uint i = YCbCrToPixels<SSE2, 0, 1, 2, 4>(y, cb, cr, output, width);
+		YCbCrToRGBAScalar(y + i, cb + i, cr + i, output + i * 4, width - i);
+	}
+
+	void GrayToRGBSSE2(const byte* gray, byte* output, uint width) {
+		const uint i = GrayToPixels<SSE2, 3>(gray, output, width);
+		GrayToRGBScalar(gray + i, output + i * 3, width - i);
+	}
+
+	void GrayToRGBASSE2(const byte* gray, byte* output, uint width) {
+		const uint i = GrayToPixels<SSE2, 4>(gray, output, width);
+		GrayToRGBAScalar(gray + i, output + i * 4, width - i);
+	}
+}
+#endif
@@ -0,0 +1,114 @@
+#include "ThreadPool.hpp"
+#include <algorithm>
+
+namespace JPG {
+	// true on worker threads and on a thread that is running a job, nested jobs run serially
+	static thread_local bool insideJob = false;
+
+	ThreadPool::ThreadPool(uint numThreads) {
+		if (numThreads == 0) {
+			numThreads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		for (uint i = 1; i < numThreads; i++) {
+			workers.emplace_back(&ThreadPool::WorkerLoop, this);
+		}
+	}
+
+	ThreadPool::~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		jobReady.notify_all();
+		for (std::thread& worker : workers) {
+			worker.join();
+		}
+	}
+
+	ThreadPool& ThreadPool::Default() {
+		static ThreadPool pool;
+		return pool;
+	}
+
+	void ThreadPool::RunTasks(Job& job) {
+		for (uint i = job.nextIndex++; i < job.count; i = job.nextIndex++) {
+			try {
+				(*job.task)(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!job.error) {
+					job.error = std::current_exception();
+				}
+				job.nextIndex = job.count;
+			}
+		}
+	}
+
+	void ThreadPool::WorkerLoop() {
+		insideJob = true;
+		while (true) {
+			Job* job = nullptr;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				jobReady.wait(lock, [this]() { return stop || !jobs.empty(); });
+				if (stop) {
+					return;
+				}
+				// the job with the fewest workers, so that jobs of different threads share them
+				auto joined = std::min_element(jobs.begin(), jobs.end(), [](const Job* a, const Job* b) { return a->activeWorkers < b->activeWorkers; });
+				job = *joined;
+				job->activeWorkers++;
+				if (--job->maxWorkers == 0) {
+					jobs.erase(joined);
+				}
+			}
+
+			RunTasks(*job);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			job->activeWorkers--;
+			if (job->activeWorkers == 0) {
+				jobDone.notify_all();
+			}
+		}
+	}
+
+	void ThreadPool::ParallelFor(uint count, const std::function<void(uint)>& task, uint maxThreads) {
+		if (insideJob || workers.empty() || count <= 1 || maxThreads == 1) {
+			for (uint i = 0; i < count; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		Job job;
+		job.task = &task;
+		job.count = count;
+		job.maxWorkers = std::min(uint(workers.size()), std::min(maxThreads == 0 ? count : maxThreads - 1, count - 1));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			jobs.push_back(&job);
+		}
+		jobReady.notify_all();
+
+		insideJob = true;
+		RunTasks(job);
+		insideJob = false;
+
+		std::exception_ptr jobError;
+		{
+			// no more workers may join, wait for the ones that did
+			std::unique_lock<std::mutex> lock(mutex);
+			const auto queued = std::find(jobs.begin(), jobs.end(), &job);
+			if (queued != jobs.end()) {
+				jobs.erase(queued);
+			}
+			jobDone.wait(lock, [&job]() { return job.activeWorkers == 0; });
+			jobError = job.error;
+		}
+		if (jobError) {
+			std::rethrow_exception(jobError);
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <exception>
+
+namespace JPG {
+	using uint = unsigned int;
+
+	// Fixed set of worker threads that run ParallelFor jobs. Jobs of different threads run at the same time and
+	// share the workers, a free worker joins the job that has the fewest of them. A ParallelFor that is called from
+	// inside a job runs on the calling thread.
+	class ThreadPool {
+	public:
+		// numThreads counts the calling thread, 0 means one thread per hardware thread
+		explicit ThreadPool(uint numThreads = 0);
+		~ThreadPool();
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		uint NumThreads() const { return uint(workers.size()) + 1; }
+
+		// runs task(0) ... task(count - 1) on at most maxThreads threads (0 = all of them) and returns once all
+		// of them are done. The first exception thrown by a task is rethrown here.
+		void ParallelFor(uint count, const std::function<void(uint)>& task, uint maxThreads = 0);
+
+		// pool shared by all decoders
+		static ThreadPool& Default();
+	private:
+		// a running ParallelFor, it lives on the stack of the thread that called it
+		struct Job {
+			const std::function<void(uint)>* task = nullptr;
+			uint count = 0;
+			std::atomic<uint> nextIndex{ 0 };
+			uint activeWorkers = 0; // workers still working on the job
+			uint maxWorkers = 0; // workers that may still join the job
+			std::exception_ptr error;
+		};
+
+		void WorkerLoop();
+		void RunTasks(Job& job);
+	private:
+		std::vector<std::thread> workers;
+		std::mutex mutex;
+		std::condition_variable jobReady;
+		std::condition_variable jobDone;
+
+		std::vector<Job*> jobs; // jobs that workers may still join
+		bool stop = false;
+	};
+}
@@ -0,0 +1,298 @@
+#include "JPGKernels.hpp"
+#include <iostream>
+#include <random>
+#include <vector>
+#include <string>
+#include <cmath>
+
+// Checks every SIMD level that this CPU supports against the scalar kernels, bit for bit.
+// Returns 1 if any kernel disagrees.
+
+namespace {
+	const JPG::SIMDLevel Levels[] = { JPG::SIMDLevel::Scalar, JPG::SIMDLevel::SSE2, JPG::SIMDLevel::AVX2, JPG::SIMDLevel::AVX512 };
+
+	const char* LevelName(const JPG::SIMDLevel level) {
+		switch (level) {
+		case JPG::SIMDLevel::SSE2:
+			return "SSE2";
+		case JPG::SIMDLevel::AVX2:
+			return "AVX2";
+		case JPG::SIMDLevel::AVX512:
+			return "AVX512";
+		default:
+			return "Scalar";
+		}
+	}
+
+	// guard bytes around every output, a kernel must not write outside of its blocks or pixels
+	const JPG::uint GuardBytes = 64;
+	const JPG::byte GuardValue = 0xA5;
+
+	struct Failures {
+		JPG::uint count = 0;
+
+		void report(const std::string& message) {
+			if (count++ < 20) {
+				std::cout << "FAIL " << message << '\n';
+			}
+		}
+	};
+
+	// random quantized blocks: the forward DCT of random 8x8 samples (noise, saturated checkerboards or gradients)
+	// quantized with a random table, so the coefficients have the range of a real baseline JPG
+	class BlockGenerator {
+	public:
+		explicit BlockGenerator(const uint32_t seed) : random(seed) {
+			for (JPG::uint u = 0; u < 8; u++) {
+				for (JPG::uint x = 0; x < 8; x++) {
+					cosines[u][x] = (u == 0 ? std::sqrt(0.125) : 0.5) * std::cos((2 * x + 1) * u * 3.14159265358979323846 / 16);
+				}
+			}
+		}
+
+		JPG::uint next(const JPG::uint end) {
+			return JPG::uint(random() % end);
+		}
+
+		void quantizationTable(uint16_t table[64]) {
+			const JPG::uint maximum = 1 + next(next(4) == 0 ? 255 : 40);
+			for (JPG::uint i = 0; i < 64; i++) {
+				table[i] = uint16_t(1 + next(maximum));
+			}
+		}
+
+		void block(const uint16_t quantizationTable[64], int16_t coefficients[64]) {
+			double samples[64];
+			const JPG::uint pattern = next(3);
+			for (JPG::uint i = 0; i < 64; i++) {
+				switch (pattern) {
+				case 0:
+					samples[i] = double(next(256)) - 128;
+					break;
+				case 1:
+					samples[i] = ((i / 8 + i) & 1) != 0 ? 127 : -128;
+					break;
+				default:
+					samples[i] = double(i % 8) * 30 - 128 + next(10);
+					break;
+				}
+			}
+			for (JPG::uint v = 0; v < 8; v++) {
+				for (JPG::uint u = 0; u < 8; u++) {
+					double sum = 0;
+					for (JPG::uint y = 0; y < 8; y++) {
+						for (JPG::uint x = 0; x < 8; x++) {
+							sum += cosines[v][y] * cosines[u][x] * samples[y * 8 + x];
+						}
+					}
+					coefficients[v * 8 + u] = int16_t(std::lround(sum / quantizationTable[v * 8 + u]));
+				}
+			}
+		}
+
+	private:
+		std::mt19937 random;
+		double cosines[8][8];
+	};
+
+	// runs kernel on numBlocks blocks into an output with guard bytes and returns the output
+	std::vector<JPG::byte> RunIDCT(const JPG::DequantizeIDCTKernel kernel, const JPG::AlignedVector<int16_t>& coefficients, const JPG::byte* lastCoefficients,
+		const uint16_t quantizationTable[64], const size_t stride, const JPG::uint blockSize, const JPG::uint numBlocks) {
+		std::vector<JPG::byte> output(GuardBytes + stride * blockSize + GuardBytes, GuardValue);
+		kernel(coefficients.data(), lastCoefficients, quantizationTable, output.data() + GuardBytes, stride, numBlocks);
+		return output;
+	}
+
+	// zigzag index of the last non-zero coefficient of a sparse block, from one of the classes that the kernels treat
+	// differently: only DC, within the top left 4x4, past it and the full block
+	JPG::uint LastCoefficient(BlockGenerator& generator, const JPG::uint sparsity) {
+		switch (sparsity) {
+		case 0:
+			return 0;
+		case 1:
+			return 1 + generator.next(JPG::LastCoefficient4x4);
+		case 2:
+			return JPG::LastCoefficient4x4 + 1 + generator.next(62 - JPG::LastCoefficient4x4);
+		default:
+			return 63;
+		}
+	}
+
+	void TestDequantizeIDCT(Failures& failures) {
+		const JPG::uint iterations = 4000;
+		BlockGenerator generator(1);
+		for (JPG::uint i = 0; i < iterations; i++) {
+			const JPG::uint numBlocks = 1 + generator.next(12);
+			uint16_t quantizationTable[64];
+			generator.quantizationTable(quantizationTable);
+			JPG::AlignedVector<int16_t> coefficients(size_t(numBlocks) * 64);
+			for (JPG::uint block = 0; block < numBlocks; block++) {
+				generator.block(quantizationTable, coefficients.data() + block * 64);
+			}
+
+			for (const JPG::uint blockSize : { 8u, 4u, 2u, 1u }) {
+				const size_t stride = numBlocks * blockSize + generator.next(9);
+				const std::vector<JPG::byte> expected = RunIDCT(JPG::GetDequantizeIDCTKernel(JPG::GetKernels(JPG::SIMDLevel::Scalar), blockSize),
+					coefficients, nullptr, quantizationTable, stride, blockSize, numBlocks);
+				for (const JPG::SIMDLevel level : Levels) {
+					if (level > JPG::DetectSIMDLevel()) {
+						continue;
+					}
+					const JPG::DequantizeIDCTKernel kernel = JPG::GetDequantizeIDCTKernel(JPG::GetKernels(level), blockSize);
+					if (RunIDCT(kernel, coefficients, nullptr, quantizationTable, stride, blockSize, numBlocks) != expected) {
+						failures.report(std::string("DequantizeIDCT ") + LevelName(level) + " " + std::to_string(blockSize) + "x" + std::to_string(blockSize) +
+							" iteration " + std::to_string(i));
+					}
+				}
+			}
+		}
+	}
+
+	// blocks that end early: the kernels skip work for them when they know lastCoefficients, which must not change
+	// a single sample compared to the full scalar transform
+	void TestSparseDequantizeIDCT(Failures& failures) {
+		const JPG::uint iterations = 4000;
+		BlockGenerator generator(2);
+		for (JPG::uint i = 0; i < iterations; i++) {
+			const JPG::uint numBlocks = 1 + generator.next(20);
+			uint16_t quantizationTable[64];
+			generator.quantizationTable(quantizationTable);
+			JPG::AlignedVector<int16_t> coefficients(size_t(numBlocks) * 64);
+			std::vector<JPG::byte> lastCoefficients(numBlocks);
+			// the same class for a whole row makes groups of blocks that all take the shorter path
+			const JPG::uint rowSparsity = generator.next(5);
+			for (JPG::uint block = 0; block < numBlocks; block++) {
+				int16_t* blockCoefficients = coefficients.data() + block * 64;
+				generator.block(quantizationTable, blockCoefficients);
+				const JPG::uint last = LastCoefficient(generator, rowSparsity < 4 ? rowSparsity : generator.next(4));
+				for (JPG::uint k = last + 1; k < 64; k++) {
+					blockCoefficients[JPG::MCUMap[k]] = 0;
+				}
+				if (blockCoefficients[JPG::MCUMap[last]] == 0) {
+					blockCoefficients[JPG::MCUMap[last]] = generator.next(2) != 0 ? 1 : -1;
+				}
+				lastCoefficients[block] = JPG::byte(last);
+			}
+
+			for (const JPG::uint blockSize : { 8u, 4u, 2u, 1u }) {
+				const size_t stride = numBlocks * blockSize + generator.next(9);
+				const std::vector<JPG::byte> expected = RunIDCT(JPG::GetDequantizeIDCTKernel(JPG::GetKernels(JPG::SIMDLevel::Scalar), blockSize),
+					coefficients, nullptr, quantizationTable, stride, blockSize, numBlocks);
+				for (const JPG::SIMDLevel level : Levels) {
+					if (level > JPG::DetectSIMDLevel()) {
+						continue;
+					}
+					const JPG::DequantizeIDCTKernel kernel = JPG::GetDequantizeIDCTKernel(JPG::GetKernels(level), blockSize);
+					if (RunIDCT(kernel, coefficients, lastCoefficients.data(), quantizationTable, stride, blockSize, numBlocks) != expected) {
+						failures.report(std::string("DequantizeIDCT with lastCoefficients ") + LevelName(level) + " " + std::to_string(blockSize) + "x" +
+							std::to_string(blockSize) + " iteration " + std::to_string(i));
+					}
+				}
+			}
+		}
+	}
+
+	// converts width pixels at random offsets into the inputs (the kernels must not rely on alignment) into an output
+	// with guard bytes and returns the output
+	std::vector<JPG::byte> RunColor(const JPG::YCbCrToRGBKernel kernel, const std::vector<JPG::byte>& y, const std::vector<JPG::byte>& cb, const std::vector<JPG::byte>& cr,
+		const JPG::uint offset, const JPG::uint width, const JPG::uint bytesPerPixel) {
+		std::vector<JPG::byte> output(GuardBytes + size_t(width) * bytesPerPixel + GuardBytes, GuardValue);
+		kernel(y.data() + offset, cb.data() + offset, cr.data() + offset, output.data() + GuardBytes, width);
+		return output;
+	}
+
+	std::vector<JPG::byte> RunGray(const JPG::GrayToRGBKernel kernel, const std::vector<JPG::byte>& gray, const JPG::uint offset, const JPG::uint width, const JPG::uint bytesPerPixel) {
+		std::vector<JPG::byte> output(GuardBytes + size_t(width) * bytesPerPixel + GuardBytes, GuardValue);
+		kernel(gray.data() + offset, output.data() + GuardBytes, width);
+		return output;
+	}
+
+	// compares the color conversions of every level with the scalar ones on the same samples
+	void CompareColor(Failures& failures, const std::vector<JPG::byte>& y, const std::vector<JPG::byte>& cb, const std::vector<JPG::byte>& cr,
+		const JPG::uint offset, const JPG::uint width, const std::string& what) {
+		const JPG::Kernels& scalar = JPG::GetKernels(JPG::SIMDLevel::Scalar);
+		const std::vector<JPG::byte> rgb = RunColor(scalar.ycbcrToRGB, y, cb, cr, offset, width, 3);
+		const std::vector<JPG::byte> bgr = RunColor(scalar.ycbcrToBGR, y, cb, cr, offset, width, 3);
+		const std::vector<JPG::byte> rgba = RunColor(scalar.ycbcrToRGBA, y, cb, cr, offset, width, 4);
+		const std::vector<JPG::byte> grayRGB = RunGray(scalar.grayToRGB, y, offset, width, 3);
+		const std::vector<JPG::byte> grayRGBA = RunGray(scalar.grayToRGBA, y, offset, width, 4);
+		for (const JPG::SIMDLevel level : Levels) {
+			if (level > JPG::DetectSIMDLevel()) {
+				continue;
+			}
+			const JPG::Kernels& kernels = JPG::GetKernels(level);
+			const std::string where = std::string(" ") + LevelName(level) + " " + what + " width " + std::to_string(width);
+			if (RunColor(kernels.ycbcrToRGB, y, cb, cr, offset, width, 3) != rgb) {
+				failures.report("YCbCrToRGB" + where);
+			}
+			if (RunColor(kernels.ycbcrToBGR, y, cb, cr, offset, width, 3) != bgr) {
+				failures.report("YCbCrToBGR" + where);
+			}
+			if (RunColor(kernels.ycbcrToRGBA, y, cb, cr, offset, width, 4) != rgba) {
+				failures.report("YCbCrToRGBA" + where);
+			}
+			if (RunGray(kernels.grayToRGB, y, offset, width, 3) != grayRGB) {
+				failures.report("GrayToRGB" + where);
+			}
+			if (RunGray(kernels.grayToRGBA, y, offset, width, 4) != grayRGBA) {
+				failures.report("GrayToRGBA" + where);
+			}
+		}
+	}
+
+	// Every combination of Y, Cb and Cr (so every corner of the color cube and every clamp) in rows of 256 * 256
+	// pixels, then random rows whose widths leave a tail after the 16 and 32 pixel steps of the SIMD kernels.
+	// The levels promise exactly the same results, which is stricter than agreeing within 1.
+	void TestColor(Failures& failures) {
+		std::vector<JPG::byte> y(256 * 256);
+		std::vector<JPG::byte> cb(256 * 256);
+		std::vector<JPG::byte> cr(256 * 256);
+		for (JPG::uint luma = 0; luma < 256; luma++) {
+			for (JPG::uint i = 0; i < 256 * 256; i++) {
+				y[i] = JPG::byte(luma);
+				cb[i] = JPG::byte(i / 256);
+				cr[i] = JPG::byte(i % 256);
+			}
+			CompareColor(failures, y, cb, cr, 0, 256 * 256, "Y " + std::to_string(luma));
+		}
+		for (JPG::uint i = 0; i < 256; i++) {
+			y[i] = JPG::byte(i);
+		}
+		CompareColor(failures, y, cb, cr, 0, 256, "all gray values");
+
+		BlockGenerator generator(3);
+		for (JPG::uint i = 0; i < 2000; i++) {
+			JPG::uint width = 1 + generator.next(300);
+			if (width % 16 == 0) {
+				width += 1 + generator.next(15);
+			}
+			const JPG::uint offset = generator.next(4);
+			for (JPG::uint x = 0; x < offset + width; x++) {
+				y[x] = JPG::byte(generator.next(256));
+				cb[x] = JPG::byte(generator.next(256));
+				cr[x] = JPG::byte(generator.next(256));
+			}
+			CompareColor(failures, y, cb, cr, offset, width, "random row " + std::to_string(i));
+		}
+	}
+}
+
+int main() {
+	std::cout << "Testing levels:";
+	for (const JPG::SIMDLevel level : Levels) {
+		std::cout << ' ' << LevelName(level) << (level > JPG::DetectSIMDLevel() ? " (not supported, skipped)" : "");
+	}
+	std::cout << std::endl;
+
+	Failures failures;
+	TestDequantizeIDCT(failures);
+	TestSparseDequantizeIDCT(failures);
+	TestColor(failures);
+
+	if (failures.count != 0) {
+		std::cout << failures.count << " failures\n";
+		return 1;
+	}
+	std::cout << "All kernels agree\n";
+	return 0;
+}